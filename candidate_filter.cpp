@@ -0,0 +1,88 @@
+// src/candidate_filter.cpp
+#include "candidate_filter.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TRACER_FILTER_SSE2 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace tracer {
+
+static inline int LowBit(unsigned v) {
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward(&i, v);
+  return (int)i;
+#else
+  return __builtin_ctz(v);
+#endif
+}
+
+static inline bool Keep(const LayerData& L, const BBox& q, const AtomicBitmap* visited, int id) {
+  if (L.maxx[id] < q.minx || q.maxx < L.minx[id] || L.maxy[id] < q.miny || q.maxy < L.miny[id]) return false;
+  return !visited || !visited->Test(id);
+}
+
+// Appends the ids of lanes set in `keep` that are not visited yet.
+static inline size_t EmitLanes(unsigned keep, const int* ids, const AtomicBitmap* visited,
+                               int* out, size_t k) {
+  while (keep) {
+    int lane = LowBit(keep);
+    keep &= keep - 1;
+    int id = ids[lane];
+    if (!visited || !visited->Test(id)) out[k++] = id;
+  }
+  return k;
+}
+
+size_t FilterCandidates(const LayerData& L, const BBox& q, const AtomicBitmap* visited,
+                        int* cand, size_t n) {
+  size_t k = 0, i = 0;
+
+#if defined(__AVX2__)
+  const __m256i qminx = _mm256_set1_epi32(q.minx), qminy = _mm256_set1_epi32(q.miny);
+  const __m256i qmaxx = _mm256_set1_epi32(q.maxx), qmaxy = _mm256_set1_epi32(q.maxy);
+  for (; i + 8 <= n; i += 8) {
+    int ids[8];
+    __m256i idx = _mm256_loadu_si256((const __m256i*)(cand + i));
+    _mm256_storeu_si256((__m256i*)ids, idx);
+    __m256i x0 = _mm256_i32gather_epi32(L.minx.data(), idx, 4);
+    __m256i y0 = _mm256_i32gather_epi32(L.miny.data(), idx, 4);
+    __m256i x1 = _mm256_i32gather_epi32(L.maxx.data(), idx, 4);
+    __m256i y1 = _mm256_i32gather_epi32(L.maxy.data(), idx, 4);
+    __m256i rej = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpgt_epi32(qminx, x1), _mm256_cmpgt_epi32(x0, qmaxx)),
+      _mm256_or_si256(_mm256_cmpgt_epi32(qminy, y1), _mm256_cmpgt_epi32(y0, qmaxy)));
+    unsigned keep = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(rej)) & 0xFFu;
+    k = EmitLanes(keep, ids, visited, cand, k);
+  }
+#elif defined(TRACER_FILTER_SSE2)
+  const __m128i qminx = _mm_set1_epi32(q.minx), qminy = _mm_set1_epi32(q.miny);
+  const __m128i qmaxx = _mm_set1_epi32(q.maxx), qmaxy = _mm_set1_epi32(q.maxy);
+  for (; i + 4 <= n; i += 4) {
+    int ids[4] = {cand[i], cand[i+1], cand[i+2], cand[i+3]};
+    __m128i x0 = _mm_setr_epi32(L.minx[ids[0]], L.minx[ids[1]], L.minx[ids[2]], L.minx[ids[3]]);
+    __m128i y0 = _mm_setr_epi32(L.miny[ids[0]], L.miny[ids[1]], L.miny[ids[2]], L.miny[ids[3]]);
+    __m128i x1 = _mm_setr_epi32(L.maxx[ids[0]], L.maxx[ids[1]], L.maxx[ids[2]], L.maxx[ids[3]]);
+    __m128i y1 = _mm_setr_epi32(L.maxy[ids[0]], L.maxy[ids[1]], L.maxy[ids[2]], L.maxy[ids[3]]);
+    __m128i rej = _mm_or_si128(
+      _mm_or_si128(_mm_cmpgt_epi32(qminx, x1), _mm_cmpgt_epi32(x0, qmaxx)),
+      _mm_or_si128(_mm_cmpgt_epi32(qminy, y1), _mm_cmpgt_epi32(y0, qmaxy)));
+    unsigned keep = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(rej)) & 0xFu;
+    k = EmitLanes(keep, ids, visited, cand, k);
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (Keep(L, q, visited, cand[i])) cand[k++] = cand[i];
+  }
+  return k;
+}
+
+} // namespace tracer
@@ -0,0 +1,19 @@
+// src/candidate_filter.h
+#pragma once
+#include <cstddef>
+#include "layout_reader.h"
+#include "parallel.h"
+#include "spatial_index.h"
+
+namespace tracer {
+
+// Batched pre-filter run between QueryCandidates and the exact geometry test.
+// Keeps the ids in cand[0,n) whose bbox in `L` touches `q` and whose bit in
+// `visited` (may be null) is still clear, compacting them to the front of
+// `cand` in their original order. Returns the number kept.
+// Uses AVX2 gathers when compiled with -mavx2, SSE2 compares on other x86-64
+// builds, and a scalar loop elsewhere.
+size_t FilterCandidates(const LayerData& L, const BBox& q, const AtomicBitmap* visited,
+                        int* cand, size_t n);
+
+} // namespace tracer
@@ -2,33 +2,141 @@
 #include "cli.h"
 #include "rule_parser.h"
 #include "layout_reader.h"
+#include "layout_cache.h"
+#include "components.h"
+#include "server.h"
 #include "engine.h"
 #include "writer.h"
+#include "parallel.h"
+#include <atomic>
 #include <iostream>
 
 namespace tracer {
 
+// Loads every rule of the batch (sharing one layer table), the union of
+// their layers once, and traces the nets concurrently over shared indices.
+// A net whose rule does not load fails alone, like one whose trace fails.
+static int RunBatch(const CmdArgs& args) {
+  std::vector<BatchJob> jobs;
+  if (!LoadBatchList(args.batch_path, jobs)) return 2;
+
+  std::vector<RuleFile> rules(jobs.size());
+  std::vector<char> loaded(jobs.size(), 0);
+  std::atomic<int> failed{0};
+  RuleFile all; // union of the loaded rules' layers
+  for (size_t j=0; j<jobs.size(); j++) {
+    rules[j].layers = all.layers;
+    if (!LoadRule(jobs[j].rule_path, rules[j])) {
+      std::cerr << "[FAIL] net " << j << ": " << jobs[j].rule_path << "\n";
+      failed++;
+      continue;
+    }
+    loaded[j] = 1;
+    all.layers = rules[j].layers;
+  }
+  for (auto& ly : all.layers.names) all.needed_layers.insert(ly);
+
+  LayoutDB db;
+  if (!LoadLayoutNeededLayers(args.layout_path, all, args.threads, db)) return 3;
+
+  ComponentLabels comps;
+  if (!args.components_path.empty() && !LoadComponents(args.components_path, comps)) return 3;
+
+  TraceOptions opt;
+  opt.threads = args.threads;
+  opt.index = args.index;
+  opt.cache_aa_cuts = true;
+  if (!args.components_path.empty()) opt.components = &comps;
+
+  TraceContext ctx;
+  BuildTraceContext(db, opt, ctx);
+
+  // nets run in parallel; threads left over go to each net's BFS
+  int workers = ParallelWorkers(args.threads, jobs.size(), 1);
+  int per_net = std::max(1, args.threads / workers);
+  std::atomic<size_t> polys{0};
+  ParallelFor(workers, jobs.size(), 1, [&](size_t b, size_t e, int){
+    for (size_t j=b; j<e; j++) {
+      if (!loaded[j]) continue;
+      ResultWriter writer;
+      bool ok = writer.Open(jobs[j].output_path) && TraceNet(rules[j], ctx, per_net, writer);
+      if (ok) ok = writer.Close();
+      else writer.Abort(); // keeps any previous result
+      if (!ok) {
+        std::cerr << "[FAIL] net " << j << ": " << jobs[j].rule_path << "\n";
+        failed++;
+        continue;
+      }
+      polys += writer.polygons();
+    }
+  });
+  LogIndexUse(ctx);
+
+  std::cerr << "[OK] nets=" << jobs.size() - failed << "/" << jobs.size()
+            << " polys_out=" << polys << "\n";
+  return failed ? 4 : 0;
+}
+
 int RunCLI(int argc, char** argv) {
   CmdArgs args;
   if (!ParseArgs(argc, argv, args)) {
     std::cerr << "Usage:\n"
-              << "  trace -layout layout.txt -rule rule.txt -output res.txt [-thread N]\n";
+              << "  trace -layout layout.txt -rule rule.txt -output res.txt [-thread N] [-index grid|rtree]\n"
+              << "  trace -layout layout.txt -batch nets.txt [-thread N] [-index grid|rtree] [-components comps.bin]\n"
+              << "    (nets.txt: one \"rule.txt res.txt\" pair per line)\n"
+              << "  trace -layout layout.txt -serve sock|- [-thread N] [-index grid|rtree]\n"
+              << "    (resident server, protocol in server.h)\n"
+              << "  trace --build-cache layout.txt layout.bin [-thread N]\n"
+              << "  trace --build-components layout.txt rule.txt comps.bin [-thread N] [-index grid|rtree]\n"
+              << "  (-components comps.bin traces with labels built for the same layout and via rules)\n"
+              << "  (-layout also accepts a layout.bin cache, or a text layout with CELL/INST\n"
+              << "   hierarchy, traced without flattening; cache and components need flat layouts)\n";
     return 1;
   }
 
+  if (!args.cache_path.empty()) {
+    LayoutDB db;
+    if (!LoadLayoutAllLayers(args.layout_path, args.threads, db)) return 3;
+    if (!WriteLayoutCache(args.cache_path, db)) return 5;
+    size_t polys = 0;
+    for (size_t id=0; id<db.NumLayers(); id++) polys += db.LayerSize(id);
+    std::cerr << "[OK] cache layers=" << db.NumLayers() << " polys=" << polys << "\n";
+    return 0;
+  }
+
+  if (!args.serve_path.empty()) return RunServer(args);
+  if (!args.batch_path.empty()) return RunBatch(args);
+
   RuleFile rule;
   if (!LoadRule(args.rule_path, rule)) return 2;
 
   LayoutDB db;
-  if (!LoadLayoutNeededLayers(args.layout_path, rule, db)) return 3;
+  if (!LoadLayoutNeededLayers(args.layout_path, rule, args.threads, db)) return 3;
+
+  if (args.build_components) {
+    ComponentLabels comps;
+    if (!ExtractComponents(rule, db, args.index, args.threads, comps)) return 4;
+    if (!WriteComponents(args.components_path, comps)) return 5;
+    std::cerr << "[OK] components=" << comps.NumComponents() << " polys=" << comps.label.size() << "\n";
+    return 0;
+  }
+
+  ComponentLabels comps;
+  if (!args.components_path.empty() && !LoadComponents(args.components_path, comps)) return 3;
 
-  TraceResult res;
-  if (!RunTrace(rule, db, args.threads, res)) return 4;
+  TraceOptions opt;
+  opt.threads = args.threads;
+  opt.index = args.index;
+  if (!args.components_path.empty()) opt.components = &comps;
 
-  if (!WriteResult(args.output_path, res)) return 5;
+  // layers are written out as the trace emits them
+  ResultWriter writer;
+  if (!writer.Open(args.output_path)) { std::cerr << "Cannot write output: " << args.output_path << "\n"; return 5; }
+  if (!RunTrace(rule, db, opt, writer)) { writer.Abort(); return 4; }
+  if (!writer.Close()) return 5;
 
-  std::cerr << "[OK] layers_out=" << res.by_layer.size()
-            << " polys_out=" << res.total_polygons << "\n";
+  std::cerr << "[OK] layers_out=" << writer.layers()
+            << " polys_out=" << writer.polygons() << "\n";
   return 0;
 }
 
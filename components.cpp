@@ -0,0 +1,259 @@
+// src/components.cpp
+#include "components.h"
+#include "candidate_filter.h"
+#include "geom_ortho.h"
+#include "parallel.h"
+#include "spatial_index.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace tracer {
+
+static const char kMagic[8] = {'T','R','C','C','O','M','P','0'};
+static const uint32_t kComponentsVersion = 1;
+
+int ComponentLabels::LayerIndex(const std::string& name) const {
+  for (size_t k=0; k<layers.size(); k++) if (layers[k] == name) return (int)k;
+  return -1;
+}
+
+std::vector<std::string> ViaPairKeys(const RuleFile& rule) {
+  std::vector<std::string> keys;
+  for (auto& vr: rule.via_rules) {
+    for (size_t i=0;i+1<vr.layers.size();i++){
+      const auto& a = std::min(vr.layers[i], vr.layers[i+1]);
+      const auto& b = std::max(vr.layers[i], vr.layers[i+1]);
+      keys.push_back(a + " " + b);
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+// Lock-free union-find. Roots are always the smallest id of their set
+// (the larger root is linked under the smaller), so the final partition
+// and its representatives do not depend on thread interleaving.
+class ConcurrentUnionFind {
+public:
+  explicit ConcurrentUnionFind(size_t n) : parent_(n) {
+    for (size_t i=0;i<n;i++) parent_[i].store((uint32_t)i, std::memory_order_relaxed);
+  }
+  uint32_t Find(uint32_t x) {
+    while (true) {
+      uint32_t p = parent_[x].load(std::memory_order_acquire);
+      if (p == x) return x;
+      uint32_t gp = parent_[p].load(std::memory_order_acquire);
+      if (gp != p) parent_[x].compare_exchange_weak(p, gp, std::memory_order_acq_rel);  // path halving
+      x = gp;
+    }
+  }
+  void Unite(uint32_t a, uint32_t b) {
+    while (true) {
+      a = Find(a); b = Find(b);
+      if (a == b) return;
+      if (a < b) std::swap(a, b);
+      uint32_t expect = a;
+      if (parent_[a].compare_exchange_strong(expect, b, std::memory_order_acq_rel)) return;
+    }
+  }
+private:
+  std::vector<std::atomic<uint32_t>> parent_;
+};
+
+// Polygons handed to each worker at a time during the spatial join.
+static const size_t kJoinGrain = 256;
+
+// Unites every polygon of layer `a` with the polygons of layer `b` it
+// touches. For a == b only pairs (i, v > i) are tested.
+static void JoinLayers(const LayerData& A, uint64_t base_a, const LayerData& B, uint64_t base_b,
+                       const SpatialIndex& idx_b, bool same, int threads, ConcurrentUnionFind& uf) {
+  int nt = ParallelWorkers(threads, A.size(), kJoinGrain);
+  std::vector<std::vector<int>> cand_local(nt);
+  ParallelFor(nt, A.size(), kJoinGrain, [&](size_t b, size_t e, int tid){
+    auto& cand = cand_local[tid];
+    for (size_t i=b; i<e; i++) {
+      PolyView pa = A.Poly(i);
+      cand.clear();
+      idx_b.QueryCandidates(pa, cand);
+      size_t nc = FilterCandidates(B, BBoxOf(pa), nullptr, cand.data(), cand.size());
+      uint32_t ga = (uint32_t)(base_a + i);
+      for (size_t k=0; k<nc; k++) {
+        int v = cand[k];
+        if (same && v <= (int)i) continue;
+        uint32_t gb = (uint32_t)(base_b + v);
+        if (uf.Find(ga) == uf.Find(gb)) continue;
+        if (PolyIntersectOrtho(pa, B.Poly(v))) uf.Unite(ga, gb);
+      }
+    }
+  });
+}
+
+bool ExtractComponents(const RuleFile& rule, const LayoutDB& db, IndexKind kind,
+                       int threads, ComponentLabels& out) {
+  if (db.hier) { std::cerr<<"Components need a flat layout\n"; return false; }
+  size_t nl = db.NumLayers();
+  out = ComponentLabels{};
+  out.layers = db.names;
+  out.via_pairs = ViaPairKeys(rule);
+  out.base.assign(nl + 1, 0);
+  for (size_t id=0; id<nl; id++) out.base[id+1] = out.base[id] + db.LayerSize(id);
+  uint64_t total = out.base[nl];
+  if (total >= UINT32_MAX) { std::cerr<<"Too many polygons for component labels\n"; return false; }
+
+  std::vector<SpatialIndex> idx;
+  BuildIndices(db, kind, std::vector<char>(nl, 1), threads, idx);
+
+  ConcurrentUnionFind uf(total);
+  for (size_t id=0; id<nl; id++) {
+    JoinLayers(db.Layer(id), out.base[id], db.Layer(id), out.base[id], idx[id], true, threads, uf);
+  }
+  std::vector<std::pair<int,int>> pairs;
+  for (auto& vr: rule.via_rules) {
+    for (size_t i=0;i+1<vr.layer_ids.size();i++){
+      int a = std::min(vr.layer_ids[i], vr.layer_ids[i+1]);
+      int b = std::max(vr.layer_ids[i], vr.layer_ids[i+1]);
+      if (a != b) pairs.emplace_back(a, b);
+    }
+  }
+  std::sort(pairs.begin(), pairs.end());
+  pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+  for (auto& pr: pairs) {
+    // probe the larger layer's index with the smaller layer's polygons
+    int a = pr.first, b = pr.second;
+    if (db.LayerSize(a) > db.LayerSize(b)) std::swap(a, b);
+    JoinLayers(db.Layer(a), out.base[a], db.Layer(b), out.base[b], idx[b], false, threads, uf);
+  }
+
+  // roots are set minima, so numbering roots in id order is deterministic
+  out.label.resize(total);
+  std::vector<uint32_t> root_comp(total, UINT32_MAX);
+  uint32_t ncomp = 0;
+  for (uint64_t g=0; g<total; g++) {
+    uint32_t r = uf.Find((uint32_t)g);
+    if (root_comp[r] == UINT32_MAX) root_comp[r] = ncomp++;
+    out.label[g] = root_comp[r];
+  }
+
+  out.comp_offs.assign((size_t)ncomp + 1, 0);
+  for (uint64_t g=0; g<total; g++) out.comp_offs[out.label[g] + 1]++;
+  for (size_t c=0; c<ncomp; c++) out.comp_offs[c+1] += out.comp_offs[c];
+  out.members.resize(total);
+  std::vector<uint64_t> cursor(out.comp_offs.begin(), out.comp_offs.end() - 1);
+  for (uint64_t g=0; g<total; g++) out.members[cursor[out.label[g]]++] = (uint32_t)g;
+  return true;
+}
+
+template <class T>
+static void Put(std::ofstream& out, const T& v) { out.write((const char*)&v, sizeof(T)); }
+
+template <class T>
+static void PutArray(std::ofstream& out, const std::vector<T>& v) {
+  Put(out, (uint64_t)v.size());
+  out.write((const char*)v.data(), v.size() * sizeof(T));
+}
+
+static void PutStr(std::ofstream& out, const std::string& s) {
+  Put(out, (uint32_t)s.size());
+  out.write(s.data(), s.size());
+}
+
+bool WriteComponents(const std::string& path, const ComponentLabels& c) {
+  std::ofstream out(path, std::ios::out | std::ios::binary);
+  if (!out) { std::cerr<<"Cannot write components: "<<path<<"\n"; return false; }
+  out.write(kMagic, sizeof(kMagic));
+  Put(out, kComponentsVersion);
+  Put(out, (uint32_t)c.layers.size());
+  for (auto& s: c.layers) PutStr(out, s);
+  Put(out, (uint32_t)c.via_pairs.size());
+  for (auto& s: c.via_pairs) PutStr(out, s);
+  PutArray(out, c.base);
+  PutArray(out, c.label);
+  PutArray(out, c.comp_offs);
+  PutArray(out, c.members);
+  if (!out) { std::cerr<<"Write failed: "<<path<<"\n"; return false; }
+  return true;
+}
+
+template <class T>
+static bool Get(std::ifstream& in, T& v) { return (bool)in.read((char*)&v, sizeof(T)); }
+
+// Bytes left after the read position.
+static uint64_t Remaining(std::ifstream& in) {
+  std::streampos pos = in.tellg();
+  in.seekg(0, std::ios::end);
+  std::streampos end = in.tellg();
+  in.seekg(pos);
+  return pos < 0 || end < pos ? 0 : (uint64_t)(end - pos);
+}
+
+template <class T>
+static bool GetArray(std::ifstream& in, std::vector<T>& v) {
+  uint64_t n = 0;
+  if (!Get(in, n) || n > Remaining(in) / sizeof(T)) return false;
+  v.resize(n);
+  return (bool)in.read((char*)v.data(), n * sizeof(T));
+}
+
+static bool GetStr(std::ifstream& in, std::string& s) {
+  uint32_t n = 0;
+  if (!Get(in, n) || n > Remaining(in)) return false;
+  s.resize(n);
+  return (bool)in.read(&s[0], n);
+}
+
+static bool Ascending(const std::vector<uint64_t>& offs) {
+  if (offs.empty() || offs[0] != 0) return false;
+  for (size_t i=1; i<offs.size(); i++) if (offs[i] < offs[i-1]) return false;
+  return true;
+}
+
+// Every index the tracer follows is in range and labels and member lists
+// agree, so a stale or damaged file is rejected instead of read out of
+// bounds. Sizes against the layout are checked per trace (MatchComponents).
+static bool Consistent(const ComponentLabels& c) {
+  if (c.base.size() != c.layers.size() + 1 || !Ascending(c.base) || c.label.size() != c.base.back() ||
+      c.members.size() != c.label.size() || !Ascending(c.comp_offs) || c.comp_offs.back() != c.members.size()) {
+    return false;
+  }
+  size_t ncomp = c.NumComponents();
+  for (uint32_t l: c.label) if (l >= ncomp) return false;
+  for (size_t k=0; k<ncomp; k++) {
+    for (uint64_t m=c.comp_offs[k]; m<c.comp_offs[k+1]; m++) {
+      uint32_t g = c.members[m];
+      if (g >= c.label.size() || c.label[g] != k) return false;
+    }
+  }
+  return true;
+}
+
+bool LoadComponents(const std::string& path, ComponentLabels& c) {
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  if (!in) { std::cerr<<"Cannot open components: "<<path<<"\n"; return false; }
+  char magic[sizeof(kMagic)];
+  uint32_t version = 0, n = 0;
+  if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+      !Get(in, version) || version != kComponentsVersion) {
+    std::cerr<<"Not a components file (or unsupported version): "<<path<<"\n";
+    return false;
+  }
+  c = ComponentLabels{};
+  bool ok = Get(in, n);
+  c.layers.resize(ok ? n : 0);
+  for (auto& s: c.layers) ok = ok && GetStr(in, s);
+  ok = ok && Get(in, n);
+  c.via_pairs.resize(ok ? n : 0);
+  for (auto& s: c.via_pairs) ok = ok && GetStr(in, s);
+  ok = ok && GetArray(in, c.base) && GetArray(in, c.label) &&
+       GetArray(in, c.comp_offs) && GetArray(in, c.members);
+  if (!ok || !Consistent(c)) {
+    std::cerr<<"Corrupt components file: "<<path<<"\n";
+    return false;
+  }
+  return true;
+}
+
+} // namespace tracer
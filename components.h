@@ -0,0 +1,39 @@
+// src/components.h
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "layout_reader.h"
+#include "rule_parser.h"
+
+namespace tracer {
+
+// Connected components of a layout under one rule's via connectivity,
+// extracted once (trace --build-components) and reused by later traces:
+// a start point then maps to its component and the component's member
+// list replaces the BFS. Polygons are numbered globally, polygon i of
+// layers[k] being base[k] + i.
+struct ComponentLabels {
+  std::vector<std::string> layers;     // layer names
+  std::vector<uint64_t> base;          // layers.size()+1 prefix sums of polygon counts
+  std::vector<std::string> via_pairs;  // connected layer pairs, see ViaPairKeys
+  std::vector<uint32_t> label;         // global polygon -> component
+  std::vector<uint64_t> comp_offs;     // component c owns members[comp_offs[c], comp_offs[c+1])
+  std::vector<uint32_t> members;       // global ids grouped by component, ascending
+
+  int LayerIndex(const std::string& name) const; // -1 if absent
+  size_t NumComponents() const { return comp_offs.empty() ? 0 : comp_offs.size() - 1; }
+};
+
+// "a b" (a < b) for every pair of layers a via rule connects, sorted and
+// unique; components are only valid for rules with the same set.
+std::vector<std::string> ViaPairKeys(const RuleFile& rule);
+
+// Parallel union-find over every same-layer and via-connected polygon pair.
+bool ExtractComponents(const RuleFile& rule, const LayoutDB& db, IndexKind kind,
+                       int threads, ComponentLabels& out);
+
+bool WriteComponents(const std::string& path, const ComponentLabels& c);
+bool LoadComponents(const std::string& path, ComponentLabels& c);
+
+} // namespace tracer
@@ -1,290 +1,559 @@
 #include "engine.h"
 #include "geom_ortho.h"
+#include "hierarchy.h"
 #include "spatial_index.h"
+#include "candidate_filter.h"
 #include "ortho_rect.h"
-#include <queue>
-#include <unordered_set>
-#include <unordered_map>
+#include "parallel.h"
 #include <algorithm>
+#include <iostream>
+#include <memory>
+#include <thread>
 
 namespace tracer {
 
-struct Node { std::string layer; int idx; };
+// BFS node packed as (part << 32 | polygon index); a flat layout's parts
+// are its layer ids (see LayoutDB).
+using Node = uint64_t;
+static inline Node PackNode(int part, int idx) { return (uint64_t)(uint32_t)part<<32 | (uint32_t)idx; }
+static inline int NodePart(Node n) { return (int)(n>>32); }
+static inline int NodeIdx(Node n) { return (int)(uint32_t)n; }
+
+// Polygon i of `part` in layout coordinates: top-level polygons as stored,
+// instance polygons placed into `buf`.
+static inline PolyView WorldPoly(const LayoutDB& db, int part, int i, std::vector<Point>& buf) {
+  PolyView pv = db.PartData(part).Poly(i);
+  if (part < (int)db.NumLayers()) return pv;
+  return TransformPoly(db.PartTransform(part), pv, buf);
+}
+
+// `pu` (layout coordinates) in the coordinates of `part`'s master.
+static inline PolyView ToPart(const LayoutDB& db, int part, const PolyView& pu, std::vector<Point>& buf) {
+  if (part < (int)db.NumLayers()) return pu;
+  return TransformPoly(db.PartTransform(part).Inverse(), pu, buf);
+}
 
-static bool PolyContainsStart(const Polygon& p, const Point& s) {
+static bool PolyContainsStart(const PolyView& p, const Point& s) {
   if (s.x < p.minx || s.x > p.maxx || s.y < p.miny || s.y > p.maxy) return false;
   return PointInPolyInclusiveOrtho(s, p);
 }
 
-static void BuildLayerIndices(
-  const LayoutDB& db,
-  std::unordered_map<std::string, SpatialIndex>& idxmap
-) {
-  idxmap.clear();
-  for (auto& kv: db.layers) {
-    const auto& layer = kv.first;
-    const auto& polys = kv.second.polys;
-    int32_t cs = AutoCellSize(polys);
-    SpatialIndex si;
-    si.Build(polys, cs);
-    idxmap.emplace(layer, std::move(si));
-  }
+void LogIndexUse(const TraceContext& ctx) {
+  size_t built = 0, masters = 0, bytes = 0;
+  double ms = 0;
+  ctx.idx.Stats(built, masters, bytes, ms);
+  std::cerr << "[INDEX] backend=" << (ctx.idx.kind()==IndexKind::RTree ? "rtree" : "grid")
+            << " layers=" << built << "/" << ctx.db->NumLayers();
+  if (ctx.db->hier) std::cerr << " masters=" << masters;
+  std::cerr << " bytes=" << bytes << " build_ms=" << ms << "\n";
+}
+
+// Replaces `cand` with the ids `si` reports for `q`, each at most once.
+static inline void QueryUnique(const SpatialIndex& si, const PolyView& q, std::vector<int>& cand) {
+  cand.clear();
+  si.QueryCandidates(q, cand);
 }
 
 static void BuildViaAdj(
   const RuleFile& rule,
-  std::unordered_map<std::string, std::vector<std::string>>& via_adj
+  int num_layers,
+  std::vector<std::vector<int>>& via_adj
 ) {
-  via_adj.clear();
+  via_adj.assign(num_layers, {});
   for (auto& vr: rule.via_rules) {
-    for (size_t i=0;i+1<vr.layers.size();i++){
-      const auto& a = vr.layers[i];
-      const auto& b = vr.layers[i+1];
+    for (size_t i=0;i+1<vr.layer_ids.size();i++){
+      int a = vr.layer_ids[i];
+      int b = vr.layer_ids[i+1];
+      if (a >= num_layers || b >= num_layers) continue; // an absent layer connects nothing
       via_adj[a].push_back(b);
       via_adj[b].push_back(a);
     }
   }
 }
 
-static void BFS_MultiLayer(
-  const RuleFile& rule,
+// Visited bitmaps of one trace by part. Top-level parts have theirs from
+// the start; an instance part gets one when the trace first looks at it,
+// so a trace costs what it reaches rather than the number of placements.
+// Created before the traversal, so another thread may Find() while it runs.
+class VisitedParts {
+public:
+  explicit VisitedParts(const LayoutDB& db) : db_(db), top_(db.NumLayers()) {
+    for (size_t id=0; id<top_.size(); id++) top_[id].Reset(db.PartSize(id));
+  }
+  AtomicBitmap& Get(int part) {
+    if (part < (int)top_.size()) return top_[part];
+    return *inst_.With(part, [&](std::unique_ptr<AtomicBitmap>& bm){
+      if (!bm) {
+        bm.reset(new AtomicBitmap);
+        bm->Reset(db_.PartSize(part));
+      }
+      return bm.get();
+    });
+  }
+  // null if the trace never looked at `part`
+  const AtomicBitmap* Find(int part) const {
+    if (part < (int)top_.size()) return &top_[part];
+    return inst_.Find(part, [](const std::unique_ptr<AtomicBitmap>* bm) -> const AtomicBitmap* {
+      return bm ? bm->get() : nullptr;
+    });
+  }
+  // Instance parts with a set bit, by layer then part.
+  std::vector<int> InstParts() const {
+    // PartLayer() walks the instance tree, so look it up once per part
+    std::vector<std::pair<int,int>> keyed;
+    inst_.ForEach([&](int part, const std::unique_ptr<AtomicBitmap>& bm){
+      if (bm->Touched()) keyed.emplace_back(db_.PartLayer(part), part);
+    });
+    std::sort(keyed.begin(), keyed.end());
+    std::vector<int> parts;
+    parts.reserve(keyed.size());
+    for (auto& kp: keyed) parts.push_back(kp.second);
+    return parts;
+  }
+private:
+  const LayoutDB& db_;
+  std::vector<AtomicBitmap> top_;
+  ShardedMap<int, std::unique_ptr<AtomicBitmap>> inst_;
+};
+
+// Marks ALL polygons containing each start point and appends them to `frontier`.
+// Candidates come from a point query on `idx`, or a scan of the top-level
+// layer when idx is null (flat layouts only).
+static void SeedStarts(
   const LayoutDB& db,
-  const std::unordered_map<std::string, SpatialIndex>& idxmap,
-  const std::vector<std::pair<std::string, Point>>& starts,
-  std::unordered_map<std::string, std::vector<char>>& visited_layer
+  const LayerIndices* idx,
+  const std::vector<StartPos>& starts,
+  VisitedParts& visited,
+  std::vector<Node>& frontier
 ) {
-  visited_layer.clear();
-  for (auto& kv: db.layers) {
-    visited_layer[kv.first].assign(kv.second.polys.size(), 0);
-  }
-
-  std::unordered_map<std::string, std::vector<std::string>> via_adj;
-  BuildViaAdj(rule, via_adj);
-
-  std::queue<Node> q;
-
-  // seed: ALL polygons containing each start point
+  std::vector<int> cand, parts;
   for (auto& st: starts) {
-    auto it = db.layers.find(st.first);
-    if (it==db.layers.end()) continue;
-    const auto& polys = it->second.polys;
-    for (int i=0;i<(int)polys.size();i++){
-      if (PolyContainsStart(polys[i], st.second)) {
-        if (!visited_layer[st.first][i]) {
-          visited_layer[st.first][i]=1;
-          q.push(Node{st.first,i});
+    parts.clear();
+    if (idx) idx->Parts(st.layer_id, BBox{st.pt.x, st.pt.y, st.pt.x, st.pt.y}, parts);
+    else if (db.LayerSize(st.layer_id) > 0) parts.push_back(st.layer_id);
+    for (int part: parts) {
+      const auto& polys = db.PartData(part);
+      const Point pt = db.PartTransform(part).Inverse().Apply(st.pt);
+      auto seed = [&](int i){
+        if (PolyContainsStart(polys.Poly(i), pt) && visited.Get(part).TrySet(i)) {
+          frontier.push_back(PackNode(part,i));
         }
+      };
+      if (idx) {
+        cand.clear();
+        idx->Get(part).QueryPoint(pt, cand);
+        for (int i: cand) seed(i);
+      } else {
+        for (int i=0;i<(int)polys.size();i++) seed(i);
       }
     }
   }
+}
+
+// Frontier items handed to each worker at a time; small enough to balance
+// levels dominated by a few huge polygons.
+static const size_t kFrontierGrain = 64;
+
+// Per-worker state of BFS_MultiLayer.
+struct BFSScratch {
+  std::vector<Node> next;
+  std::vector<int> cand, parts;
+  std::vector<Point> world, local;  // the expanded polygon placed / mapped into a master
+};
+
+// Level-synchronous BFS: every node of the current frontier is expanded in
+// parallel, and a node joins the next frontier only if its TrySet() wins.
+// The reached set is the connected component of the seeds, so the result
+// does not depend on thread count or scheduling.
+static void BFS_MultiLayer(
+  const RuleFile& rule,
+  const LayoutDB& db,
+  const LayerIndices& idx,
+  const std::vector<StartPos>& starts,
+  int threads,
+  VisitedParts& visited
+) {
+  int nl = (int)db.NumLayers();
+  std::vector<std::vector<int>> via_adj;
+  BuildViaAdj(rule, nl, via_adj);
+
+  std::vector<Node> frontier;
+  SeedStarts(db, &idx, starts, visited, frontier);
+
+  std::vector<BFSScratch> scratch;
+
+  while (!frontier.empty()) {
+    int nt = ParallelWorkers(threads, frontier.size(), kFrontierGrain);
+    scratch.resize(nt);
+    for (auto& sc: scratch) sc.next.clear();
+
+    ParallelFor(nt, frontier.size(), kFrontierGrain, [&](size_t b, size_t e, int tid){
+      auto& sc = scratch[tid];
+      auto& cand = sc.cand;
+      for (size_t fi=b; fi<e; fi++) {
+        int part = NodePart(frontier[fi]);
+        const PolyView pu = WorldPoly(db, part, NodeIdx(frontier[fi]), sc.world);
+        const BBox qb = BBoxOf(pu);
+
+        // every part of `layer` near pu, each tested in its master's
+        // coordinates, so instance geometry is never materialized
+        auto expand = [&](int layer) {
+          sc.parts.clear();
+          idx.Parts(layer, qb, sc.parts);
+          for (int q: sc.parts) {
+            const auto& polys = db.PartData(q);
+            const PolyView lu = ToPart(db, q, pu, sc.local);
+            QueryUnique(idx.Get(q), lu, cand);
+            auto& vis = visited.Get(q);
+            size_t nc = FilterCandidates(polys, BBoxOf(lu), &vis, cand.data(), cand.size());
+            for (size_t k=0; k<nc; k++) {
+              int v = cand[k];
+              if (PolyIntersectOrtho(lu, polys.Poly(v)) && vis.TrySet(v)) {
+                sc.next.push_back(PackNode(q,v));
+              }
+            }
+          }
+        };
 
-  std::vector<int> cand;
-  cand.reserve(2048);
-
-  while (!q.empty()) {
-    Node cur = q.front(); q.pop();
-    const auto& layer = cur.layer;
-    const auto& polys = db.layers.at(layer).polys;
-    const Polygon& pu = polys[cur.idx];
-
-    // same-layer expansion
-    cand.clear();
-    idxmap.at(layer).QueryCandidates(pu, cand);
-    std::sort(cand.begin(), cand.end());
-    cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
-
-    for (int v: cand) {
-      if (v==cur.idx) continue;
-      if (visited_layer[layer][v]) continue;
-      if (PolyIntersectOrtho(pu, polys[v])) {
-        visited_layer[layer][v]=1;
-        q.push(Node{layer,v});
+        // same-layer expansion (pu is visited, so the filter drops it too),
+        // then via expansion
+        int layer = db.PartLayer(part);
+        expand(layer);
+        for (int nb : via_adj[layer]) expand(nb);
       }
-    }
+    });
 
-    // via expansion
-    auto itadj = via_adj.find(layer);
-    if (itadj!=via_adj.end()) {
-      for (const auto& nb : itadj->second) {
-        auto itL = db.layers.find(nb);
-        if (itL==db.layers.end()) continue;
-        const auto& polysB = itL->second.polys;
+    frontier.clear();
+    for (auto& sc: scratch) frontier.insert(frontier.end(), sc.next.begin(), sc.next.end());
+  }
+}
 
-        cand.clear();
-        idxmap.at(nb).QueryCandidates(pu, cand);
-        std::sort(cand.begin(), cand.end());
-        cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
+// Checks that `comp` was extracted from this layout under this rule's via
+// connectivity and maps each db layer id to its layer in `comp`.
+static bool MatchComponents(
+  const ComponentLabels& comp,
+  const RuleFile& rule,
+  const LayoutDB& db,
+  std::vector<int>& comp_layer
+) {
+  if (db.hier) {
+    std::cerr << "Components need a flat layout\n";
+    return false;
+  }
+  if (comp.via_pairs != ViaPairKeys(rule)) {
+    std::cerr << "Components were built for a different via rule set\n";
+    return false;
+  }
+  comp_layer.assign(db.NumLayers(), -1);
+  for (size_t id=0; id<db.NumLayers(); id++) {
+    int k = comp.LayerIndex(db.names[id]);
+    if (k < 0 || comp.base[k+1] - comp.base[k] != db.LayerSize(id)) {
+      std::cerr << "Components do not match layout layer: " << db.names[id] << "\n";
+      return false;
+    }
+    comp_layer[id] = k;
+  }
+  return true;
+}
 
-        for (int v: cand) {
-          if (visited_layer[nb][v]) continue;
-          if (PolyIntersectOrtho(pu, polysB[v])) {
-            visited_layer[nb][v]=1;
-            q.push(Node{nb,v});
-          }
+// Same reached set as BFS_MultiLayer, read from precomputed components:
+// the seeds' labels select whole member lists, so no intersection tests.
+// Seeds come from a point query on `idx`, or from a scan of the start layer
+// when idx is null: building a whole index to seed one net does not pay.
+static void ComponentVisited(
+  const ComponentLabels& comp,
+  const std::vector<int>& comp_layer,
+  const LayoutDB& db,
+  const LayerIndices* idx,
+  const std::vector<StartPos>& starts,
+  VisitedParts& visited
+) {
+  int nl = (int)db.NumLayers();
+  std::vector<Node> seeds;
+  SeedStarts(db, idx, starts, visited, seeds);
+  std::vector<uint32_t> labels;
+  for (Node n: seeds) labels.push_back(comp.label[comp.base[comp_layer[NodePart(n)]] + NodeIdx(n)]);
+  std::sort(labels.begin(), labels.end());
+  labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+
+  std::vector<int> db_layer(comp.layers.size(), -1);
+  for (int id=0; id<nl; id++) db_layer[comp_layer[id]] = id;
+  for (uint32_t c: labels) {
+    for (uint64_t m=comp.comp_offs[c]; m<comp.comp_offs[c+1]; m++) {
+      uint64_t g = comp.members[m];
+      int k = (int)(std::upper_bound(comp.base.begin(), comp.base.end(), g) - comp.base.begin()) - 1;
+      if (db_layer[k] >= 0) visited.Get(db_layer[k]).TrySet((size_t)(g - comp.base[k]));
+    }
+  }
+}
+
+// Streams the visited polygons of every layer to `out` in layer-name order,
+// a layer's parts in part order. For a Q3 net the AA layer (aa_id) is taken
+// from `aa_cut` instead, each reached AA polygon contributing its cut pieces.
+static void EmitLayers(
+  const LayoutDB& db,
+  const VisitedParts& visited,
+  int aa_id,
+  const std::unordered_map<Node, AACutCache::Polys>* aa_cut,
+  ResultSink& out
+) {
+  std::vector<int> order(db.NumLayers());
+  for (int id=0; id<(int)order.size(); id++) order[id] = id;
+  std::sort(order.begin(), order.end(), [&](int a, int b){ return db.names[a] < db.names[b]; });
+
+  const std::vector<int> inst = visited.InstParts();
+  std::vector<int> parts;
+  std::vector<Point> buf;
+  for (int id: order) {
+    parts.assign(1, id);
+    auto lo = std::lower_bound(inst.begin(), inst.end(), id, [&](int p, int l){ return db.PartLayer(p) < l; });
+    for (; lo != inst.end() && db.PartLayer(*lo) == id; ++lo) parts.push_back(*lo);
+    bool begun = false;
+    auto add = [&](const Point* pts, size_t n) {
+      if (!begun) { out.BeginLayer(db.names[id]); begun = true; }
+      out.AddPolygon(pts, n);
+    };
+    for (int part: parts) {
+      const auto& flags = *visited.Find(part);
+      if (!flags.Touched()) continue;
+      for (size_t i=0;i<flags.size();i++){
+        if (!flags.Test(i)) continue;
+        if (id == aa_id) {
+          for (auto& p: aa_cut->at(PackNode(part,(int)i))) add(p.data(), p.size());
+        } else {
+          PolyView pv = WorldPoly(db, part, (int)i, buf);
+          add(pv.pts, pv.n);
         }
       }
     }
   }
 }
 
+// ResultSink that fills a TraceResult.
+class CollectSink : public ResultSink {
+public:
+  explicit CollectSink(TraceResult& r) : r_(r) { r_.by_layer.clear(); r_.total_polygons = 0; }
+  void BeginLayer(const std::string& name) override { cur_ = &r_.by_layer[name]; }
+  void AddPolygon(const Point* pts, size_t n) override {
+    cur_->emplace_back(pts, pts + n);
+    r_.total_polygons++;
+  }
+private:
+  TraceResult& r_;
+  std::vector<std::vector<Point>>* cur_ = nullptr;
+};
+
 // --- Q3 AA cutting using rect decomposition ---
-// AA_final = (AA - (AA ∩ LOW)) ∪ (AA ∩ HIGH)
-// Here we approximate via rect operations exactly on Manhattan grid.
+// AA_final = (AA - LOW) ∪ (AA ∩ HIGH), exact on the Manhattan grid.
+// Every rect temporary comes from `mr`; only the returned polygons outlive it.
 static std::vector<std::vector<Point>> CutAAByPoly_Rect(
-  const Polygon& aa,
-  const std::vector<const Polygon*>& poly_high,
-  const std::vector<const Polygon*>& poly_low
+  const PolyView& aa,
+  const std::vector<PolyView>& poly_high,
+  const std::vector<PolyView>& poly_low,
+  std::pmr::memory_resource* mr
 ){
-  // 1) AA -> rects
-  auto aa_rects = DecomposeToRects(aa);
-
-  // 2) LOW polys -> rects union list (not merged, but ok for difference)
-  std::vector<Rect> low_rects;
-  for (auto* p : poly_low) {
-    auto rs = DecomposeToRects(*p);
-    low_rects.insert(low_rects.end(), rs.begin(), rs.end());
-  }
+  RectVec aa_rects(mr), low_rects(mr), high_rects(mr);
+  DecomposeToRects(aa, aa_rects);
+  for (auto& p : poly_low) DecomposeToRects(p, low_rects);
+  for (auto& p : poly_high) DecomposeToRects(p, high_rects);
+
+  RectVec aa_cut(mr), aa_on(mr), aa_final(mr);
+  RectBoolean(aa_rects, low_rects, RectBoolOp::Difference, aa_cut);
+  RectBoolean(aa_rects, high_rects, RectBoolOp::Intersect, aa_on);
+  // both disjoint and merged, so the union feeds edge cancellation cleanly
+  RectBoolean(aa_cut, aa_on, RectBoolOp::Union, aa_final);
+  return RectsToPolygons(aa_final);
+}
 
-  // 3) HIGH polys -> rects (for re-adding)
-  std::vector<Rect> high_rects;
-  for (auto* p : poly_high) {
-    auto rs = DecomposeToRects(*p);
-    high_rects.insert(high_rects.end(), rs.begin(), rs.end());
-  }
+// Initial arena block per AA worker; a cut that outgrows it continues on
+// the heap until the arena is dropped.
+static const size_t kAAArenaBytes = 256 << 10;
+
+// Per-worker state of CutAAList, reused across the AA polygons it cuts.
+struct AAScratch {
+  std::vector<int> cand, parts;
+  std::vector<Node> high_ids;
+  std::vector<PolyView> poly_high, poly_low;
+  std::vector<Point> aa_pts, local;
+  // placed poly polygons; growing the outer vector moves the inner ones
+  // without moving their points, so views into them stay valid
+  std::vector<std::vector<Point>> placed;
+  std::vector<char> arena;
+};
+
+// Cuts each AA polygon of `aa_list` against the poly layer, split into the
+// polygons `high` (bitmaps by part) marks and the rest, writing *cut[k].
+static void CutAAList(
+  const TraceContext& ctx,
+  int poly_id,
+  const std::vector<Node>& aa_list,
+  const VisitedParts& high,
+  int threads,
+  const std::vector<AACutCache::Polys*>& cut
+) {
+  const LayoutDB& db = *ctx.db;
+  const bool use_cache = ctx.opt.cache_aa_cuts;
+  int nt = ParallelWorkers(threads, aa_list.size(), 1);
+  std::vector<AAScratch> scratch(nt);
+  ParallelFor(nt, aa_list.size(), 1, [&](size_t b, size_t e, int tid){
+    auto& sc = scratch[tid];
+    auto& cand = sc.cand;
+    auto& poly_high = sc.poly_high;
+    auto& poly_low = sc.poly_low;
+    auto& high_ids = sc.high_ids;
+    if (sc.arena.empty()) sc.arena.resize(kAAArenaBytes);
+    for (size_t k=b; k<e; k++) {
+      const Node an = aa_list[k];
+      const PolyView aa = WorldPoly(db, NodePart(an), NodeIdx(an), sc.aa_pts);
+
+      // candidate poly intersecting AA, in (part, index) order so the cut
+      // is independent of the backend's report order
+      poly_high.clear();
+      poly_low.clear();
+      high_ids.clear();
+      size_t nplaced = 0;
+      sc.parts.clear();
+      ctx.idx.Parts(poly_id, BBoxOf(aa), sc.parts);
+      for (int q: sc.parts) {
+        const auto& poly_polys = db.PartData(q);
+        const PolyView la = ToPart(db, q, aa, sc.local);
+        QueryUnique(ctx.idx.Get(q), la, cand);
+        cand.resize(FilterCandidates(poly_polys, BBoxOf(la), nullptr, cand.data(), cand.size()));
+        std::sort(cand.begin(), cand.end());
+        const AtomicBitmap* hq = high.Find(q);
+        for (int pi: cand) {
+          PolyView pp = poly_polys.Poly(pi);
+          if (!PolyIntersectOrtho(la, pp)) continue;
+          if (q >= (int)db.NumLayers()) {
+            if (nplaced == sc.placed.size()) sc.placed.emplace_back();
+            pp = TransformPoly(db.PartTransform(q), pp, sc.placed[nplaced++]);
+          }
+          if (hq && hq->Test(pi)) { poly_high.push_back(pp); high_ids.push_back(PackNode(q, pi)); }
+          else poly_low.push_back(pp);
+        }
+      }
 
-  // 4) AA_cut = AA_rects - low_rects
-  auto aa_cut = RectDifference(aa_rects, low_rects);
-
-  // 5) AA_on = intersection(AA, HIGH) using rect overlap (rect-level)
-  // Instead of boolean library, compute AA ∩ HIGH by intersecting each AA rect with each HIGH rect
-  std::vector<Rect> aa_on;
-  aa_on.reserve(aa_rects.size()/4 + 16);
-
-  for (auto& ar : aa_rects) {
-    for (auto& hr : high_rects) {
-      int32_t x1 = std::max(ar.x1, hr.x1);
-      int32_t y1 = std::max(ar.y1, hr.y1);
-      int32_t x2 = std::min(ar.x2, hr.x2);
-      int32_t y2 = std::min(ar.y2, hr.y2);
-      if (x1 < x2 && y1 < y2) aa_on.push_back(Rect{x1,y1,x2,y2});
+      if (use_cache && ctx.aa_cache.Find(an, poly_id, high_ids, *cut[k])) continue;
+      {
+        // bump-allocated per AA and released wholesale when it goes out of scope
+        std::pmr::monotonic_buffer_resource arena(sc.arena.data(), sc.arena.size());
+        *cut[k] = CutAAByPoly_Rect(aa, poly_high, poly_low, &arena);
+      }
+      if (use_cache) ctx.aa_cache.Store(an, poly_id, high_ids, *cut[k]);
     }
-  }
-
-  // 6) final rects = aa_cut + aa_on (not merged; boundary cancel will handle overlaps)
-  aa_cut.insert(aa_cut.end(), aa_on.begin(), aa_on.end());
-
-  // 7) rects -> polygons
-  return RectsToPolygons(aa_cut);
+  });
 }
 
-bool RunTrace(const RuleFile& rule, const LayoutDB& db, int threads, TraceResult& out) {
-  (void)threads;
-  out.by_layer.clear();
-  out.total_polygons = 0;
-
-  std::unordered_map<std::string, SpatialIndex> idxmap;
-  BuildLayerIndices(db, idxmap);
+void BuildTraceContext(const LayoutDB& db, const TraceOptions& opt, TraceContext& ctx) {
+  ctx.db = &db;
+  ctx.opt = opt;
+  ctx.idx.Init(db, opt.index, opt.threads);
+}
 
+bool TraceNet(const RuleFile& rule, const TraceContext& ctx, int threads, ResultSink& out) {
+  const LayoutDB& db = *ctx.db;
+  const TraceOptions& opt = ctx.opt;
+  const auto& idx = ctx.idx;
   bool is_q3 = (rule.starts.size() >= 2) && rule.gate.has_gate;
 
+  std::vector<int> comp_layer;
+  if (opt.components && !MatchComponents(*opt.components, rule, db, comp_layer)) return false;
+  auto trace = [&](const StartPos& st, VisitedParts& vis, int nt) {
+    if (opt.components) ComponentVisited(*opt.components, comp_layer, db, ctx.one_shot ? nullptr : &idx, {st}, vis);
+    else BFS_MultiLayer(rule, db, idx, {st}, nt, vis);
+  };
+
   if (!is_q3) {
     // Q1/Q2
-    std::unordered_map<std::string, std::vector<char>> vis;
-    BFS_MultiLayer(rule, db, idxmap, {rule.starts[0]}, vis);
-
-    for (auto& kv: vis) {
-      const auto& layer = kv.first;
-      const auto& flags = kv.second;
-      const auto& polys = db.layers.at(layer).polys;
-      std::vector<std::vector<Point>> outs;
-      outs.reserve(polys.size());
-      for (int i=0;i<(int)flags.size();i++){
-        if (flags[i]) outs.push_back(polys[i].pts);
-      }
-      if (!outs.empty()) {
-        out.by_layer[layer] = std::move(outs);
-        out.total_polygons += out.by_layer[layer].size();
-      }
-    }
+    VisitedParts vis(db);
+    trace(rule.starts[0], vis, threads);
+    if (!db.LayersOk()) return false;
+    EmitLayers(db, vis, -1, nullptr, out);
     return true;
   }
 
   // Q3
-  // Phase A: start1 -> mark poly_high
-  std::unordered_map<std::string, std::vector<char>> vis_s1;
-  BFS_MultiLayer(rule, db, idxmap, {rule.starts[0]}, vis_s1);
-
-  std::unordered_set<int> poly_high_set;
-  auto itPoly = db.layers.find(rule.gate.poly_layer);
-  if (itPoly != db.layers.end()) {
-    const auto& f = vis_s1[rule.gate.poly_layer];
-    for (int i=0;i<(int)f.size();i++) if (f[i]) poly_high_set.insert(i);
-  }
-
-  // Phase B: start2 -> trace connectivity
-  std::unordered_map<std::string, std::vector<char>> vis_s2;
-  BFS_MultiLayer(rule, db, idxmap, {rule.starts[1]}, vis_s2);
-
-  // output all layers except AA first
-  for (auto& kv: vis_s2) {
-    const auto& layer = kv.first;
-    if (layer == rule.gate.aa_layer) continue;
-    const auto& flags = kv.second;
-    const auto& polys = db.layers.at(layer).polys;
-
-    std::vector<std::vector<Point>> outs;
-    outs.reserve(polys.size());
-    for (int i=0;i<(int)flags.size();i++){
-      if (flags[i]) outs.push_back(polys[i].pts);
-    }
-    if (!outs.empty()) {
-      out.by_layer[layer] = std::move(outs);
-      out.total_polygons += out.by_layer[layer].size();
+  const int poly_id = rule.gate.poly_id;
+  const int aa_id = rule.gate.aa_id;
+
+  VisitedParts vis_s1(db), vis_s2(db);
+
+  // cut[n] is the cut of reached AA polygon n, entered when it is first listed
+  std::unordered_map<Node, AACutCache::Polys> cut;
+  auto cut_reached = [&](int nt) {
+    std::vector<Node> aa_list;
+    std::vector<AACutCache::Polys*> aa_cut;
+    std::vector<int> aa_parts;
+    if (aa_id < (int)db.NumLayers()) aa_parts.push_back(aa_id);
+    for (int part: vis_s2.InstParts()) if (db.PartLayer(part) == aa_id) aa_parts.push_back(part);
+    for (int part: aa_parts) {
+      const auto& aa_flags = *vis_s2.Find(part);
+      if (!aa_flags.Touched()) continue;
+      for (int ai=0; ai<(int)aa_flags.size(); ai++) {
+        if (!aa_flags.Test(ai)) continue;
+        auto ins = cut.emplace(PackNode(part, ai), AACutCache::Polys{});
+        if (!ins.second) continue;
+        aa_list.push_back(ins.first->first);
+        aa_cut.push_back(&ins.first->second);
+      }
     }
+    CutAAList(ctx, poly_id, aa_list, vis_s1, nt, aa_cut);
+  };
+
+  if (threads < 2) {
+    // Phase A: start1 -> mark poly_high; Phase B: start2 -> trace connectivity
+    trace(rule.starts[0], vis_s1, 1);
+    trace(rule.starts[1], vis_s2, 1);
+  } else {
+    // Phases A and B only share read-only data, so they run side by side.
+    // Once A has fixed poly_high, its thread starts cutting the AA polygons
+    // B has reached so far; B's bitmap only grows, so the rest are cut
+    // after the join.
+    int threads_a = threads / 2;
+    std::thread phase_a([&]{
+      trace(rule.starts[0], vis_s1, threads_a);
+      cut_reached(threads_a);
+    });
+    trace(rule.starts[1], vis_s2, threads - threads_a);
+    phase_a.join();
   }
+  cut_reached(threads);
+  if (!db.LayersOk()) return false;
 
-  // AA cutting
-  auto itAA = db.layers.find(rule.gate.aa_layer);
-  if (itAA != db.layers.end() && itPoly != db.layers.end()) {
-    const auto& aa_polys  = itAA->second.polys;
-    const auto& aa_flags  = vis_s2[rule.gate.aa_layer];
-    const auto& poly_polys = itPoly->second.polys;
-
-    std::vector<std::vector<Point>> aa_out;
-    std::vector<int> cand;
-    cand.reserve(2048);
-
-    for (int ai=0; ai<(int)aa_flags.size(); ai++){
-      if (!aa_flags[ai]) continue;
-      const Polygon& aa = aa_polys[ai];
-
-      // candidate poly intersecting AA
-      cand.clear();
-      idxmap.at(rule.gate.poly_layer).QueryCandidates(aa, cand);
-      std::sort(cand.begin(), cand.end());
-      cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
-
-      std::vector<const Polygon*> poly_high;
-      std::vector<const Polygon*> poly_low;
-
-      for (int pi: cand) {
-        const Polygon& pp = poly_polys[pi];
-        if (!PolyIntersectOrtho(aa, pp)) continue;
-        if (poly_high_set.count(pi)) poly_high.push_back(&pp);
-        else poly_low.push_back(&pp);
-      }
+  // AA pieces follow AA part and index order, so the result does not depend on scheduling
+  EmitLayers(db, vis_s2, aa_id, &cut, out);
+  return true;
+}
 
-      auto cut_polys = CutAAByPoly_Rect(aa, poly_high, poly_low);
-      aa_out.insert(aa_out.end(), cut_polys.begin(), cut_polys.end());
-    }
+bool TraceNet(const RuleFile& rule, const TraceContext& ctx, int threads, TraceResult& out) {
+  CollectSink sink(out);
+  return TraceNet(rule, ctx, threads, sink);
+}
 
-    if (!aa_out.empty()) {
-      out.by_layer[rule.gate.aa_layer] = std::move(aa_out);
-      out.total_polygons += out.by_layer[rule.gate.aa_layer].size();
-    }
-  }
+bool AACutCache::Find(uint64_t aa, int poly_id, const std::vector<uint64_t>& high, Polys& out) const {
+  return map_.Find(aa, [&](const Entry* e){
+    if (!e || e->poly_id != poly_id || e->high != high) return false;
+    out = e->polys;
+    return true;
+  });
+}
 
-  return true;
+void AACutCache::Store(uint64_t aa, int poly_id, const std::vector<uint64_t>& high, const Polys& polys) {
+  map_.With(aa, [&](Entry& e){ e = Entry{poly_id, high, polys}; });
+}
+
+bool RunTrace(const RuleFile& rule, const LayoutDB& db, const TraceOptions& opt, ResultSink& out) {
+  TraceContext ctx;
+  BuildTraceContext(db, opt, ctx);
+  ctx.one_shot = true;
+  bool ok = TraceNet(rule, ctx, opt.threads, out);
+  LogIndexUse(ctx);
+  return ok;
+}
+
+bool RunTrace(const RuleFile& rule, const LayoutDB& db, const TraceOptions& opt, TraceResult& out) {
+  CollectSink sink(out);
+  return RunTrace(rule, db, opt, sink);
 }
 
 } // namespace tracer
@@ -1,6 +1,9 @@
 #pragma once
 #include "rule_parser.h"
 #include "layout_reader.h"
+#include "components.h"
+#include "spatial_index.h"
+#include "parallel.h"
 #include <unordered_map>
 #include <vector>
 
@@ -11,6 +14,59 @@ struct TraceResult {
   size_t total_polygons = 0;
 };
 
-bool RunTrace(const RuleFile& rule, const LayoutDB& db, int threads, TraceResult& out);
+// Receives a trace's output one layer at a time: layers in name order, each
+// layer's polygons in part, then index order (LayoutDB), layers without
+// polygons skipped. Lets a writer stream the result instead of holding a
+// TraceResult copy of it.
+class ResultSink {
+public:
+  virtual ~ResultSink() = default;
+  virtual void BeginLayer(const std::string& name) = 0;
+  virtual void AddPolygon(const Point* pts, size_t n) = 0;
+};
+
+struct TraceOptions {
+  int threads = 1;
+  IndexKind index = IndexKind::Grid;
+  // Precomputed labels (trace --build-components); replaces the BFS when set.
+  const ComponentLabels* components = nullptr;
+  // Keep Q3 AA cuts in the context for later nets (batch/server).
+  bool cache_aa_cuts = false;
+};
+
+// Q3 AA cuts keyed by AA polygon (part << 32 | index, see LayoutDB). An
+// entry is reused while its poly layer and the set of touching poly polygons
+// classified "high" are unchanged, so a re-run with another start1 only
+// recuts AA shapes whose split changed.
+class AACutCache {
+public:
+  using Polys = std::vector<std::vector<Point>>;
+  bool Find(uint64_t aa, int poly_id, const std::vector<uint64_t>& high, Polys& out) const;
+  void Store(uint64_t aa, int poly_id, const std::vector<uint64_t>& high, const Polys& polys);
+private:
+  struct Entry { int poly_id; std::vector<uint64_t> high; Polys polys; };
+  ShardedMap<uint64_t, Entry> map_;
+};
+
+// Read-only state shared by every net traced against one layout.
+struct TraceContext {
+  const LayoutDB* db = nullptr;
+  TraceOptions opt;
+  LayerIndices idx;              // built per layer as traces reach it
+  mutable AACutCache aa_cache;   // used when opt.cache_aa_cuts
+  bool one_shot = false;         // RunTrace's own, dropped after one net
+};
+
+void BuildTraceContext(const LayoutDB& db, const TraceOptions& opt, TraceContext& ctx);
+// Reports the indices built so far to stderr; call between traces.
+void LogIndexUse(const TraceContext& ctx);
+
+// Traces one net; safe to call concurrently on a shared context. Rule
+// layer ids past the layout's (names it lacks) trace as empty layers.
+bool TraceNet(const RuleFile& rule, const TraceContext& ctx, int threads, ResultSink& out);
+bool TraceNet(const RuleFile& rule, const TraceContext& ctx, int threads, TraceResult& out);
+
+bool RunTrace(const RuleFile& rule, const LayoutDB& db, const TraceOptions& opt, ResultSink& out);
+bool RunTrace(const RuleFile& rule, const LayoutDB& db, const TraceOptions& opt, TraceResult& out);
 
 } // namespace tracer
@@ -1,11 +1,13 @@
 // src/geom_ortho.cpp
 #include "geom_ortho.h"
 #include <algorithm>
+#include <climits>
 #include <cstdint>
+#include <vector>
 
 namespace tracer {
 
-static inline bool BBoxOverlap(const Polygon& a, const Polygon& b) {
+static inline bool BBoxOverlap(const PolyView& a, const PolyView& b) {
   return !(a.maxx < b.minx || b.maxx < a.minx || a.maxy < b.miny || b.maxy < a.miny);
 }
 
@@ -16,9 +18,14 @@ static inline bool OnSegment(const Point& p, const Point& a, const Point& b) {
           std::min(y1,y2) <= y && y <= std::max(y1,y2));
 }
 
-bool PointInPolyInclusiveOrtho(const Point& pt, const Polygon& poly) {
-  const auto& P = poly.pts;
-  int n=(int)P.size();
+static inline bool InBBox(const Point& p, const PolyView& r) {
+  return r.minx <= p.x && p.x <= r.maxx && r.miny <= p.y && p.y <= r.maxy;
+}
+
+bool PointInPolyInclusiveOrtho(const Point& pt, const PolyView& poly) {
+  if (poly.shape == kShapeRect) return InBBox(pt, poly);
+  const Point* P = poly.pts;
+  int n=(int)poly.n;
   for (int i=0;i<n;i++){
     if (OnSegment(pt, P[i], P[(i+1)%n])) return true;
   }
@@ -72,10 +79,27 @@ static inline bool SegIntersectManhattan(const Point& a1, const Point& a2, const
   return !(amaxx < bminx || bmaxx < aminx || amaxy < bminy || bmaxy < aminy);
 }
 
-bool PolyIntersectOrtho(const Polygon& a, const Polygon& b) {
-  if (!BBoxOverlap(a,b)) return false;
-  const auto& A=a.pts; const auto& B=b.pts;
-  int na=(int)A.size(), nb=(int)B.size();
+// Axis-parallel segment a1-a2 touches the closed box r.
+static inline bool SegTouchesBox(const Point& a1, const Point& a2, const PolyView& r) {
+  int32_t x0=std::min(a1.x,a2.x), x1=std::max(a1.x,a2.x);
+  int32_t y0=std::min(a1.y,a2.y), y1=std::max(a1.y,a2.y);
+  return !(x1 < r.minx || r.maxx < x0 || y1 < r.miny || r.maxy < y0);
+}
+
+// Closed rect r vs Manhattan polygon p: some edge of p touches r, or r
+// lies inside p (then any corner of r does).
+static bool RectPolyIntersect(const PolyView& r, const PolyView& p) {
+  const Point* P = p.pts;
+  int n=(int)p.n;
+  for (int i=0;i<n;i++){
+    if (SegTouchesBox(P[i], P[(i+1)%n], r)) return true;
+  }
+  return PointInPolyInclusiveOrtho(Point{r.minx, r.miny}, p);
+}
+
+static bool PolyPolyIntersect(const PolyView& a, const PolyView& b) {
+  const Point* A=a.pts; const Point* B=b.pts;
+  int na=(int)a.n, nb=(int)b.n;
 
   for (int i=0;i<na;i++){
     Point a1=A[i], a2=A[(i+1)%na];
@@ -89,4 +113,115 @@ bool PolyIntersectOrtho(const Polygon& a, const Polygon& b) {
   return false;
 }
 
+// ---- edge sweep for large Manhattan pairs ----
+// Above this na*nb the O((na+nb) log) sweep beats the edge-pair loop.
+static const int64_t kSweepMinEdgePairs = 4096;
+
+// Axis-parallel edge: fixed coordinate `at`, span [lo,hi] along the other axis.
+struct AxisEdge { int32_t at, lo, hi; int owner; };
+
+struct SweepScratch {
+  std::vector<AxisEdge> ah, av, bh, bv, coll;
+  std::vector<int32_t> keys;
+  std::vector<int> fen;
+  struct Ev { int32_t x; int type; int32_t a, b; };  // type 0 insert, 1 query, 2 remove
+  std::vector<Ev> ev;
+};
+
+// Splits p's edges into horizontal and vertical lists. A zero-length edge
+// is a point and goes to both.
+static void SplitEdges(const PolyView& p, int owner, std::vector<AxisEdge>& h, std::vector<AxisEdge>& v) {
+  h.clear(); v.clear();
+  int n=(int)p.n;
+  for (int i=0;i<n;i++){
+    const Point& a = p.pts[i];
+    const Point& b = p.pts[(i+1)%n];
+    if (a.y==b.y) h.push_back(AxisEdge{a.y, std::min(a.x,b.x), std::max(a.x,b.x), owner});
+    if (a.x==b.x) v.push_back(AxisEdge{a.x, std::min(a.y,b.y), std::max(a.y,b.y), owner});
+  }
+}
+
+// Does any horizontal edge in H cross or touch any vertical edge in V?
+// Sweeps x: a horizontal edge is active over [lo,hi]; each vertical edge
+// asks a Fenwick tree over the active y values for a hit in [lo,hi].
+static bool HVCross(const std::vector<AxisEdge>& H, const std::vector<AxisEdge>& V, SweepScratch& s) {
+  if (H.empty() || V.empty()) return false;
+  auto& keys = s.keys;
+  keys.clear();
+  for (auto& e: H) keys.push_back(e.at);
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  s.fen.assign(keys.size() + 1, 0);
+  auto rank = [&](int32_t y) { return (int)(std::lower_bound(keys.begin(), keys.end(), y) - keys.begin()); };
+  auto add = [&](int i, int d) { for (++i; i<(int)s.fen.size(); i+=i&-i) s.fen[i]+=d; };
+  auto prefix = [&](int i) { int r=0; for (; i>0; i-=i&-i) r+=s.fen[i]; return r; };
+
+  auto& ev = s.ev;
+  ev.clear();
+  for (auto& e: H) {
+    ev.push_back({e.lo, 0, e.at, 0});
+    ev.push_back({e.hi, 2, e.at, 0});
+  }
+  for (auto& e: V) ev.push_back({e.at, 1, e.lo, e.hi});
+  std::sort(ev.begin(), ev.end(), [](const SweepScratch::Ev& a, const SweepScratch::Ev& b){
+    return a.x!=b.x ? a.x<b.x : a.type<b.type;
+  });
+  for (auto& e: ev) {
+    if (e.type==0) add(rank(e.a), 1);
+    else if (e.type==2) add(rank(e.a), -1);
+    else {
+      int lo = rank(e.a);
+      int hi = (int)(std::upper_bound(keys.begin(), keys.end(), e.b) - keys.begin());
+      if (hi > lo && prefix(hi) - prefix(lo) > 0) return true;
+    }
+  }
+  return false;
+}
+
+// Do edges of different owners lie on a common line and overlap?
+static bool CollinearOverlap(std::vector<AxisEdge>& E) {
+  std::sort(E.begin(), E.end(), [](const AxisEdge& a, const AxisEdge& b){
+    return a.at!=b.at ? a.at<b.at : a.lo<b.lo;
+  });
+  for (size_t i=0; i<E.size(); ) {
+    size_t j=i;
+    int64_t reach[2] = {INT64_MIN, INT64_MIN};  // furthest hi so far per owner
+    for (; j<E.size() && E[j].at==E[i].at; j++) {
+      if (E[j].lo <= reach[1-E[j].owner]) return true;
+      reach[E[j].owner] = std::max<int64_t>(reach[E[j].owner], E[j].hi);
+    }
+    i=j;
+  }
+  return false;
+}
+
+static bool ManhattanSweepIntersect(const PolyView& a, const PolyView& b) {
+  // containment first: O(n) and settles most overlapping pairs early
+  if (PointInPolyInclusiveOrtho(a.pts[0], b)) return true;
+  if (PointInPolyInclusiveOrtho(b.pts[0], a)) return true;
+
+  thread_local SweepScratch s;
+  SplitEdges(a, 0, s.ah, s.av);
+  SplitEdges(b, 1, s.bh, s.bv);
+  if (HVCross(s.ah, s.bv, s) || HVCross(s.bh, s.av, s)) return true;
+
+  s.coll.assign(s.ah.begin(), s.ah.end());
+  s.coll.insert(s.coll.end(), s.bh.begin(), s.bh.end());
+  if (CollinearOverlap(s.coll)) return true;
+  s.coll.assign(s.av.begin(), s.av.end());
+  s.coll.insert(s.coll.end(), s.bv.begin(), s.bv.end());
+  return CollinearOverlap(s.coll);
+}
+
+bool PolyIntersectOrtho(const PolyView& a, const PolyView& b) {
+  if (!BBoxOverlap(a,b)) return false;
+  bool ra = a.shape == kShapeRect, rb = b.shape == kShapeRect;
+  if (ra && rb) return true;
+  if (ra && b.shape == kShapeManhattan) return RectPolyIntersect(a, b);
+  if (rb && a.shape == kShapeManhattan) return RectPolyIntersect(b, a);
+  if (a.shape == kShapeManhattan && b.shape == kShapeManhattan &&
+      (int64_t)a.n * b.n >= kSweepMinEdgePairs) return ManhattanSweepIntersect(a, b);
+  return PolyPolyIntersect(a, b);
+}
+
 } // namespace tracer
@@ -2,6 +2,6 @@
 #pragma once
 #include "layout_reader.h"
 namespace tracer {
-bool PointInPolyInclusiveOrtho(const Point& pt, const Polygon& poly);
-bool PolyIntersectOrtho(const Polygon& a, const Polygon& b);
+bool PointInPolyInclusiveOrtho(const Point& pt, const PolyView& poly);
+bool PolyIntersectOrtho(const PolyView& a, const PolyView& b);
 }
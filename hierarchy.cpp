@@ -0,0 +1,182 @@
+// src/hierarchy.cpp
+#include "hierarchy.h"
+#include <atomic>
+#include <climits>
+#include <iostream>
+
+namespace tracer {
+
+bool ParseOrientation(const std::string& s, Transform& t) {
+  static const struct { const char* name; int32_t a, b, c, d; } kOrients[] = {
+    {"R0", 1, 0, 0, 1},    {"R90", 0, -1, 1, 0},   {"R180", -1, 0, 0, -1}, {"R270", 0, 1, -1, 0},
+    {"MX", 1, 0, 0, -1},   {"MY", -1, 0, 0, 1},    {"MXR90", 0, 1, 1, 0},  {"MYR90", 0, -1, -1, 0},
+  };
+  for (auto& o: kOrients) {
+    if (s != o.name) continue;
+    t.a = o.a; t.b = o.b; t.c = o.c; t.d = o.d;
+    return true;
+  }
+  return false;
+}
+
+PolyView TransformPoly(const Transform& t, const PolyView& p, std::vector<Point>& buf) {
+  buf.resize(p.n);
+  bool rev = t.Mirrored();
+  for (uint32_t i=0; i<p.n; i++) buf[rev ? p.n-1-i : i] = t.Apply(p.pts[i]);
+  BBox b = ApplyBox(t, BBoxOf(p));
+  return PolyView{buf.data(), p.n, b.minx, b.miny, b.maxx, b.maxy, p.shape};
+}
+
+int Hierarchy::CellId(const std::string& name) {
+  auto it = ids_.find(name);
+  if (it != ids_.end()) return it->second;
+  int id = (int)cells_.size();
+  cells_.emplace_back();
+  cells_.back().name = name;
+  cells_.back().layers.resize(nl_);
+  ids_.emplace(name, id);
+  return id;
+}
+
+bool Hierarchy::Define(int cell) {
+  if (cells_[cell].defined) return false;
+  cells_[cell].defined = true;
+  return true;
+}
+
+LayerData& Hierarchy::MasterLayer(int cell, int layer) { return cells_[cell].layers[layer]; }
+
+void Hierarchy::AddInstance(int parent, int child, const Transform& t) {
+  C(parent).insts.push_back(Inst{child, t});
+}
+
+static const BBox kNoBox{INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN};
+static inline bool HasBox(const BBox& b) { return b.minx <= b.maxx; }
+static inline void Grow(BBox& b, const BBox& o) {
+  b.minx = std::min(b.minx, o.minx); b.miny = std::min(b.miny, o.miny);
+  b.maxx = std::max(b.maxx, o.maxx); b.maxy = std::max(b.maxy, o.maxy);
+}
+// Counts saturate: a deep enough tree outgrows any integer.
+static inline int64_t SatAdd(int64_t a, int64_t b) { return a > INT64_MAX - b ? INT64_MAX : a + b; }
+
+// Fills in the part layout, tree boxes and totals of one placement of
+// `cell`, after those of the cells it places; each cell is counted once.
+bool Hierarchy::Count(int cell, std::vector<char>& state) {
+  Cell& c = C(cell);
+  char& st = state[cell + 1];  // 1 while open, 2 once counted
+  if (st == 2) return true;
+  if (!c.defined) { std::cerr << "Undefined cell: " << c.name << "\n"; return false; }
+  if (st == 1) { std::cerr << "Cell instantiates itself: " << c.name << "\n"; return false; }
+  st = 1;
+
+  c.own.clear();
+  c.own_part.assign(nl_, -1);
+  c.tree_box.assign(nl_, kNoBox);
+  c.nplaces = cell < 0 ? 0 : 1;
+  c.npolys = 0;
+  for (size_t id=0; id<nl_; id++) {
+    if (c.layers[id].empty()) continue;
+    c.own_part[id] = (int)c.own.size();
+    c.own.push_back((int)id);
+    c.tree_box[id] = mbox_[MasterKey(cell, (int)id)];
+    c.npolys += (int64_t)c.layers[id].size();
+  }
+
+  int64_t n = (int64_t)c.own.size();
+  c.first.clear();
+  for (auto& in: c.insts) {
+    if (!Count(in.cell, state)) return false;
+    const Cell& k = cells_[in.cell];
+    c.first.push_back(n);
+    n = SatAdd(n, k.first.back());
+    c.nplaces = SatAdd(c.nplaces, k.nplaces);
+    c.npolys = SatAdd(c.npolys, k.npolys);
+    for (size_t id=0; id<nl_; id++) {
+      if (HasBox(k.tree_box[id])) Grow(c.tree_box[id], ApplyBox(in.t, k.tree_box[id]));
+    }
+  }
+  c.first.push_back(n);
+  st = 2;
+  return true;
+}
+
+bool Hierarchy::Resolve() {
+  // bbox of every master, in its cell's coordinates
+  mbox_.assign(NumMasters(), kNoBox);
+  for (size_t key=0; key<mbox_.size(); key++) {
+    const LayerData& L = Master(key);
+    for (size_t i=0; i<L.size(); i++) Grow(mbox_[key], BBoxOf(L, i));
+  }
+
+  static std::atomic<uint64_t> next_serial{1};
+  serial_ = next_serial.fetch_add(1, std::memory_order_relaxed);
+  std::vector<char> state(cells_.size() + 1, 0);
+  if (!Count(-1, state)) return false;
+  nparts_ = root_.first.back();
+  nplaces_ = root_.nplaces;
+  npolys_ = root_.npolys;
+  // parts are int ids, and Node packs them into 32 bits
+  if (nparts_ > (int64_t)INT_MAX - (int64_t)nl_) {
+    std::cerr << "Hierarchy places more layer parts than an int id can number\n";
+    return false;
+  }
+
+  inst_boxes_.assign(NumInstSlots(), LayerData{});
+  inst_box_ids_.assign(NumInstSlots(), {});
+  for (int cell=-1; cell<(int)cells_.size(); cell++) {
+    if (state[cell + 1] != 2) continue;  // not placed from the top level
+    const std::vector<Inst>& insts = C(cell).insts;
+    for (size_t j=0; j<insts.size(); j++) {
+      const Cell& k = cells_[insts[j].cell];
+      for (size_t id=0; id<nl_; id++) {
+        if (!HasBox(k.tree_box[id])) continue;
+        BBox b = ApplyBox(insts[j].t, k.tree_box[id]);
+        LayerData& boxes = inst_boxes_[InstSlot(cell, (int)id)];
+        boxes.pts.insert(boxes.pts.end(), {Point{b.minx, b.miny}, Point{b.maxx, b.miny},
+                                           Point{b.maxx, b.maxy}, Point{b.minx, b.maxy}});
+        boxes.EndPoly(b.minx, b.miny, b.maxx, b.maxy);
+        inst_box_ids_[InstSlot(cell, (int)id)].push_back((int)j);
+      }
+    }
+  }
+  return true;
+}
+
+int Hierarchy::Locate(size_t part, int& layer, Transform* t) const {
+  // The BFS asks for the data, transform and master of one part in a row,
+  // so each thread keeps its last walk.
+  struct Last { uint64_t serial = 0; size_t part = 0; int cell = 0, layer = 0; Transform t; };
+  thread_local Last last;
+  if (last.serial != serial_ || last.part != part) {
+    int64_t off = (int64_t)(part - nl_);
+    int cell = -1;
+    Transform acc;
+    while (true) {
+      const Cell& c = C(cell);
+      if (off < (int64_t)c.own.size()) { last = Last{serial_, part, cell, c.own[off], acc}; break; }
+      // the last instance starting at or before `off`
+      size_t j = std::upper_bound(c.first.begin(), c.first.end() - 1, off) - c.first.begin() - 1;
+      off -= c.first[j];
+      acc = c.insts[j].t.Then(acc);
+      cell = c.insts[j].cell;
+    }
+  }
+  layer = last.layer;
+  if (t) *t = last.t;
+  return last.cell;
+}
+
+Transform Hierarchy::PartTransform(size_t part) const {
+  Transform t;
+  int layer;
+  Locate(part, layer, &t);
+  return t;
+}
+
+size_t Hierarchy::MasterPolys() const {
+  size_t n = 0;
+  for (size_t key=0; key<NumMasters(); key++) n += Master(key).size();
+  return n;
+}
+
+} // namespace tracer
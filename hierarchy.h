@@ -0,0 +1,116 @@
+// src/hierarchy.h
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "layout_reader.h"
+#include "spatial_index.h"
+
+namespace tracer {
+
+// Orientation of an INST line: R0, R90, R180, R270 rotate counterclockwise;
+// MX / MY mirror about the x / y axis; MXR90 / MYR90 mirror, then rotate.
+bool ParseOrientation(const std::string& s, Transform& t);
+
+// Polygon `p` placed by `t`, written to `buf`. A mirroring placement
+// reverses the vertex order, so the polygon stays CCW.
+PolyView TransformPoly(const Transform& t, const PolyView& p, std::vector<Point>& buf);
+
+// Cell masters and instance placements of a hierarchical layout.
+// The parser fills in the cells; Resolve() then checks the instance tree
+// and numbers the parts it places (see LayoutDB) without expanding it.
+// A part's placement is found by walking down from the top level through
+// per-cell part counts, and LayerIndices::Parts() walks down the same way
+// through each cell's instance bboxes, so memory and load time follow the
+// CELL and INST lines of the file, not the flattened instance count.
+class Hierarchy {
+public:
+  struct Inst { int cell; Transform t; };
+
+  explicit Hierarchy(size_t num_layers) : nl_(num_layers) {
+    root_.defined = true;
+    root_.layers.resize(num_layers);
+  }
+
+  // Id of cell `name`, created on first mention (an INST may come first).
+  int CellId(const std::string& name);
+  // Marks the cell's CELL block seen; false if it already was.
+  bool Define(int cell);
+  LayerData& MasterLayer(int cell, int layer);
+  // Places `child` in `parent` (-1 for the top level).
+  void AddInstance(int parent, int child, const Transform& t);
+  // Numbers the parts; false on an undefined or recursive cell, or if the
+  // flattened layout has more parts than an int id can number.
+  bool Resolve();
+
+  // Instance parts, numbered from the layer count on in depth-first
+  // placement order: a placement's own parts (one per non-empty layer of
+  // its cell, by layer) come before those of the instances inside it.
+  size_t NumInstParts() const { return (size_t)nparts_; }
+  int PartLayer(size_t part) const { int layer; Locate(part, layer, nullptr); return layer; }
+  Transform PartTransform(size_t part) const;  // master -> layout coordinates
+  // Master behind a part, as cell * layer count + layer.
+  size_t PartMaster(size_t part) const {
+    int layer, cell = Locate(part, layer, nullptr);
+    return MasterKey(cell, layer);
+  }
+  const LayerData& PartData(size_t part) const { return Master(PartMaster(part)); }
+
+  size_t NumMasters() const { return cells_.size() * nl_; }
+  size_t MasterKey(int cell, int layer) const { return (size_t)cell * nl_ + layer; }
+  const LayerData& Master(size_t key) const { return cells_[key / nl_].layers[key % nl_]; }
+  const BBox& MasterBox(size_t key) const { return mbox_[key]; }
+
+  // The instance tree, walked down from the top level (cell -1). A
+  // placement of `cell` whose first part is f owns parts f + OwnPart(cell,
+  // layer), and instance j inside it starts at f + InstFirst(cell, j); the
+  // top level starts at NumLayers().
+  const std::vector<Inst>& Insts(int cell) const { return C(cell).insts; }
+  int OwnPart(int cell, int layer) const { return C(cell).own_part[layer]; }  // -1 if empty
+  int64_t InstFirst(int cell, size_t j) const { return C(cell).first[j]; }
+  // Bboxes, in `cell`'s coordinates, of its instances with polygons on
+  // `layer` anywhere below them, one rect each; InstBoxIds() maps a rect
+  // to its instance. Slots are numbered by InstSlot().
+  size_t NumInstSlots() const { return (cells_.size() + 1) * nl_; }
+  size_t InstSlot(int cell, int layer) const { return (size_t)(cell + 1) * nl_ + layer; }
+  const LayerData& InstBoxes(int cell, int layer) const { return inst_boxes_[InstSlot(cell, layer)]; }
+  const std::vector<int>& InstBoxIds(int cell, int layer) const { return inst_box_ids_[InstSlot(cell, layer)]; }
+
+  size_t NumCells() const { return cells_.size(); }
+  size_t NumPlacements() const { return (size_t)nplaces_; }
+  size_t MasterPolys() const;
+  size_t PlacedPolys() const { return (size_t)npolys_; }  // polygon count once flattened
+
+private:
+  struct Cell {
+    std::string name;
+    bool defined = false;
+    std::vector<LayerData> layers;  // by layer id
+    std::vector<Inst> insts;
+    // filled by Resolve() for cells placed from the top level
+    std::vector<int> own;           // non-empty layers, increasing
+    std::vector<int> own_part;      // by layer: index in `own`, or -1
+    std::vector<int64_t> first;     // by instance, then the cell's part count
+    std::vector<BBox> tree_box;     // by layer: bbox of the cell with its instances
+    int64_t nplaces = 0, npolys = 0;
+  };
+  // Cell `cell`, or the top level as a cell without polygons for -1.
+  const Cell& C(int cell) const { return cell < 0 ? root_ : cells_[cell]; }
+  Cell& C(int cell) { return cell < 0 ? root_ : cells_[cell]; }
+  bool Count(int cell, std::vector<char>& state);
+  // Cell of the placement that owns `part`; sets the part's layer and, if
+  // t is set, the placement's transform.
+  int Locate(size_t part, int& layer, Transform* t) const;
+
+  size_t nl_;
+  std::vector<Cell> cells_;
+  std::unordered_map<std::string, int> ids_;
+  Cell root_;
+  std::vector<BBox> mbox_;  // by master key
+  std::vector<LayerData> inst_boxes_;         // by InstSlot()
+  std::vector<std::vector<int>> inst_box_ids_;
+  int64_t nparts_ = 0, nplaces_ = 0, npolys_ = 0;
+  uint64_t serial_ = 0;  // tells Locate()'s per-thread memo which hierarchy it holds
+};
+
+} // namespace tracer
@@ -0,0 +1,220 @@
+// src/layout_cache.cpp
+#include "layout_cache.h"
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+namespace tracer {
+
+static_assert(sizeof(Point) == 2 * sizeof(int32_t), "Point must be two packed int32");
+
+static const char kMagic[8] = {'T','R','C','C','A','C','H','E'};
+static const uint32_t kEndianTag = 0x01020304u;
+
+struct TocEntry {
+  std::string name;
+  uint64_t npolys = 0, nverts = 0, offset = 0;
+};
+
+static inline uint64_t Align8(uint64_t x) { return (x + 7) & ~(uint64_t)7; }
+
+// A polygon takes at least this many block bytes (bbox, offset, shape),
+// a vertex exactly this many.
+static const uint64_t kPolyBytes = 4 * sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint8_t);
+static const uint64_t kVertBytes = 2 * sizeof(int32_t);
+
+// Only for counts that fit in the file (see ReadToc), so it cannot overflow.
+static uint64_t BlockBytes(uint64_t npolys, uint64_t nverts) {
+  return npolys * 4 * sizeof(int32_t) + (npolys + 1) * sizeof(uint64_t) + nverts * 2 * sizeof(int32_t)
+       + npolys * sizeof(uint8_t);
+}
+
+template <class T>
+static void Put(std::ofstream& out, const T& v) { out.write((const char*)&v, sizeof(T)); }
+
+template <class T>
+static void PutArray(std::ofstream& out, const std::vector<T>& v) {
+  out.write((const char*)v.data(), v.size() * sizeof(T));
+}
+
+template <class T>
+static void GetArray(const char*& p, size_t n, std::vector<T>& v) {
+  v.resize(n);
+  std::memcpy(v.data(), p, n * sizeof(T));
+  p += n * sizeof(T);
+}
+
+bool IsLayoutCache(const MappedFile& mf) {
+  return mf.size() >= sizeof(kMagic) && std::memcmp(mf.data(), kMagic, sizeof(kMagic)) == 0;
+}
+
+bool WriteLayoutCache(const std::string& path, const LayoutDB& db) {
+  if (db.hier) { std::cerr<<"The layout cache holds flat layouts only\n"; return false; }
+  std::ofstream out(path, std::ios::out | std::ios::binary);
+  if (!out) { std::cerr<<"Cannot write cache: "<<path<<"\n"; return false; }
+
+  size_t nl = db.NumLayers();
+  std::vector<TocEntry> toc(nl);
+  uint64_t pos = sizeof(kMagic) + 3 * sizeof(uint32_t);
+  for (size_t id=0; id<nl; id++) {
+    toc[id].name = db.names[id];
+    toc[id].npolys = db.Layer(id).size();
+    toc[id].nverts = db.Layer(id).pts.size();
+    pos += sizeof(uint32_t) + toc[id].name.size() + 3 * sizeof(uint64_t);
+  }
+  for (size_t id=0; id<nl; id++) {
+    pos = Align8(pos);
+    toc[id].offset = pos;
+    pos += BlockBytes(toc[id].npolys, toc[id].nverts);
+  }
+
+  out.write(kMagic, sizeof(kMagic));
+  Put(out, kLayoutCacheVersion);
+  Put(out, kEndianTag);
+  Put(out, (uint32_t)nl);
+  uint64_t written = sizeof(kMagic) + 3 * sizeof(uint32_t);
+  for (auto& t: toc) {
+    Put(out, (uint32_t)t.name.size());
+    out.write(t.name.data(), t.name.size());
+    Put(out, t.npolys); Put(out, t.nverts); Put(out, t.offset);
+    written += sizeof(uint32_t) + t.name.size() + 3 * sizeof(uint64_t);
+  }
+
+  static const char kPad[8] = {0};
+  for (size_t id=0; id<nl; id++) {
+    out.write(kPad, toc[id].offset - written);
+    const auto& L = db.Layer(id);
+    PutArray(out, L.minx);
+    PutArray(out, L.miny);
+    PutArray(out, L.maxx);
+    PutArray(out, L.maxy);
+    PutArray(out, L.offs);
+    PutArray(out, L.pts);
+    PutArray(out, L.shape);
+    written = toc[id].offset + BlockBytes(toc[id].npolys, toc[id].nverts);
+  }
+  if (!out) { std::cerr<<"Write failed: "<<path<<"\n"; return false; }
+  return true;
+}
+
+// Bounds-checked sequential reads over the mapped header.
+struct CacheReader {
+  const char* p; const char* end;
+  template <class T> bool Get(T& v) {
+    if ((size_t)(end - p) < sizeof(T)) return false;
+    std::memcpy(&v, p, sizeof(T)); p += sizeof(T); return true;
+  }
+  bool GetStr(std::string& s, uint32_t n) {
+    if ((size_t)(end - p) < n) return false;
+    s.assign(p, n); p += n; return true;
+  }
+};
+
+static bool ReadToc(const MappedFile& mf, std::vector<TocEntry>& toc) {
+  CacheReader rd{mf.data() + sizeof(kMagic), mf.data() + mf.size()};
+  uint32_t version = 0, endian = 0, nl = 0;
+  if (!rd.Get(version) || !rd.Get(endian) || !rd.Get(nl)) { std::cerr<<"Truncated layout cache\n"; return false; }
+  if (version != kLayoutCacheVersion || endian != kEndianTag) {
+    std::cerr<<"Unsupported layout cache version "<<version<<"\n";
+    return false;
+  }
+  toc.clear();
+  for (uint32_t i=0; i<nl; i++) {
+    TocEntry t;
+    uint32_t len = 0;
+    if (!rd.Get(len) || !rd.GetStr(t.name, len) ||
+        !rd.Get(t.npolys) || !rd.Get(t.nverts) || !rd.Get(t.offset)) {
+      std::cerr<<"Truncated layout cache\n";
+      return false;
+    }
+    if (t.npolys > mf.size() / kPolyBytes || t.nverts > mf.size() / kVertBytes) {
+      std::cerr<<"Corrupt layout cache entry for layer "<<t.name<<"\n";
+      return false;
+    }
+    toc.push_back(std::move(t));
+  }
+  return true;
+}
+
+bool LayoutCacheLayerNames(const MappedFile& mf, std::vector<std::string>& names) {
+  std::vector<TocEntry> toc;
+  if (!ReadToc(mf, toc)) return false;
+  names.clear();
+  for (auto& t: toc) names.push_back(t.name);
+  return true;
+}
+
+// Checks that the block lies inside the map, without touching it.
+static bool CheckBlock(const MappedFile& mf, const TocEntry& t) {
+  if (t.offset > mf.size() || BlockBytes(t.npolys, t.nverts) > mf.size() - t.offset) {
+    std::cerr<<"Corrupt layout cache block for layer "<<t.name<<"\n";
+    return false;
+  }
+  return true;
+}
+
+// Copies the block out of the map. False, leaving L empty, unless the
+// vertex offsets start at 0, never decrease and stay within the vertex count.
+static bool ReadBlock(const MappedFile& mf, const TocEntry& t, LayerData& L) {
+  const char* blk = mf.data() + t.offset;
+  size_t n = t.npolys;
+  GetArray(blk, n, L.minx);
+  GetArray(blk, n, L.miny);
+  GetArray(blk, n, L.maxx);
+  GetArray(blk, n, L.maxy);
+  GetArray(blk, n + 1, L.offs);
+  GetArray(blk, t.nverts, L.pts);
+  GetArray(blk, n, L.shape);
+  mf.Release(t.offset, BlockBytes(t.npolys, t.nverts)); // copied; keep it resident once, not twice
+  bool ok = L.offs[0] == 0;
+  for (size_t j=1; ok && j<=n; j++) ok = L.offs[j] >= L.offs[j-1] && L.offs[j] <= t.nverts;
+  if (!ok) {
+    std::cerr<<"Corrupt layout cache offsets for layer "<<t.name<<"\n";
+    L = LayerData{};
+  }
+  return ok;
+}
+
+// Cache layers by LayerTable id (ids the cache lacks have an empty entry),
+// each copied out of the map the first time it is asked for.
+class CacheLayers : public LayerSource {
+public:
+  CacheLayers(std::shared_ptr<const MappedFile> mf, std::vector<TocEntry> toc)
+    : mf_(std::move(mf)), toc_(std::move(toc)),
+      once_(new std::once_flag[toc_.size()]), layers_(toc_.size()) {}
+  size_t Size(int id) const override { return toc_[id].npolys; }
+  const LayerData& Get(int id) const override {
+    std::call_once(once_[id], [&]{
+      if (toc_[id].npolys && !ReadBlock(*mf_, toc_[id], layers_[id])) ok_.store(false);
+    });
+    return layers_[id];
+  }
+  bool Ok() const override { return ok_.load(); }
+private:
+  std::shared_ptr<const MappedFile> mf_;
+  std::vector<TocEntry> toc_;
+  std::unique_ptr<std::once_flag[]> once_;
+  mutable std::vector<LayerData> layers_;
+  mutable std::atomic<bool> ok_{true};
+};
+
+bool LoadLayoutCache(const std::shared_ptr<const MappedFile>& mf, const LayerTable& table, LayoutDB& out) {
+  std::vector<TocEntry> toc;
+  if (!ReadToc(*mf, toc)) return false;
+
+  std::vector<TocEntry> by_id(table.names.size());
+  for (TocEntry& t: toc) {
+    int id = table.Find(t.name);
+    if (id < 0) continue;
+    if (!CheckBlock(*mf, t)) return false;
+    by_id[id] = std::move(t);
+  }
+  out.names = table.names;
+  out.layers.clear();
+  out.source = std::make_shared<CacheLayers>(mf, std::move(by_id));
+  return true;
+}
+
+} // namespace tracer
@@ -0,0 +1,29 @@
+// src/layout_cache.h
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "layout_reader.h"
+#include "mapped_file.h"
+
+namespace tracer {
+
+// Binary layout cache (trace --build-cache). Layout, native little-endian:
+//   header   magic "TRCCACHE", u32 version, u32 endian tag, u32 layer count
+//   toc      per layer: u32 name length, name bytes, u64 polygon count,
+//            u64 vertex count, u64 block offset
+//   blocks   per layer, 8-byte aligned: i32 minx[n], miny[n], maxx[n],
+//            maxy[n], u64 vertex offset[n+1], i32 xy[2*vertices],
+//            u8 shape[n] (ShapeKind)
+static const uint32_t kLayoutCacheVersion = 2;
+
+bool IsLayoutCache(const MappedFile& mf);
+// Layer names in table-of-contents order.
+bool LayoutCacheLayerNames(const MappedFile& mf, std::vector<std::string>& names);
+bool WriteLayoutCache(const std::string& path, const LayoutDB& db);
+// Maps the layers of `table` from a cache; others are skipped. Block bounds
+// and vertex offsets are checked here, but a layer's arrays are copied out
+// only when out.Layer() first asks for it, so `out` keeps `mf` mapped.
+bool LoadLayoutCache(const std::shared_ptr<const MappedFile>& mf, const LayerTable& table, LayoutDB& out);
+
+} // namespace tracer
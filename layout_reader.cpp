@@ -1,68 +1,415 @@
 // src/layout_reader.cpp
 #include "layout_reader.h"
+#include "layout_cache.h"
+#include "hierarchy.h"
+#include "mapped_file.h"
+#include "parallel.h"
 #include "utils.h"
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <string_view>
 
 namespace tracer {
 
-static bool ParsePolyLine(const std::string& line, Polygon& poly) {
-  poly.pts.clear();
+// Parses an optionally signed decimal at p (leading blanks allowed, like
+// stoll); returns the position after the digits or nullptr.
+static inline const char* ParseInt(const char* p, const char* e, int64_t& v) {
+  while (p < e && (*p==' '||*p=='\t')) ++p;
+  if (p < e && *p=='+') ++p;
+  auto r = std::from_chars(p, e, v);
+  if (r.ec != std::errc()) return nullptr;
+  return r.ptr;
+}
+
+// "(x,y),(x,y),..." in [b,e) -> appended to `out` in place.
+static bool ParsePolyLine(const char* b, const char* e, LayerData& out) {
+  size_t start = out.pts.size();
   bool first=true;
   int64_t minx=0,miny=0,maxx=0,maxy=0;
 
-  size_t i=0, n=line.size();
-  while (i<n) {
-    while (i<n && line[i] != '(') i++;
-    if (i>=n) break;
-    i++;
-    size_t cm = line.find(',', i);
-    if (cm==std::string::npos) return false;
-    size_t rp = line.find(')', cm);
-    if (rp==std::string::npos) return false;
-
-    int32_t x = (int32_t)std::stoll(line.substr(i, cm-i));
-    int32_t y = (int32_t)std::stoll(line.substr(cm+1, rp-cm-1));
-    poly.pts.push_back(Point{x,y});
+  const char* p = b;
+  while (p<e) {
+    p = (const char*)std::memchr(p, '(', e-p);
+    if (!p) break;
+    p++;
+    const char* cm = (const char*)std::memchr(p, ',', e-p);
+    const char* rp = cm ? (const char*)std::memchr(cm, ')', e-cm) : nullptr;
+    int64_t xv, yv;
+    if (!rp || !ParseInt(p, cm, xv) || !ParseInt(cm+1, rp, yv)) { out.AbortPoly(); return false; }
+    int32_t x = (int32_t)xv;
+    int32_t y = (int32_t)yv;
+    out.pts.push_back(Point{x,y});
 
     if (first) { minx=maxx=x; miny=maxy=y; first=false; }
     else {
-      if (x<minx) minx=x; if (x>maxx) maxx=x;
-      if (y<miny) miny=y; if (y>maxy) maxy=y;
+      if (x<minx) minx=x;
+      if (x>maxx) maxx=x;
+      if (y<miny) miny=y;
+      if (y>maxy) maxy=y;
     }
-    i = rp+1;
+    p = rp+1;
   }
 
-  if (poly.pts.size() < 4) return false;
-  poly.minx=(int32_t)minx; poly.miny=(int32_t)miny; poly.maxx=(int32_t)maxx; poly.maxy=(int32_t)maxy;
+  if (out.pts.size() - start < 4) { out.AbortPoly(); return false; }
+  out.EndPoly((int32_t)minx, (int32_t)miny, (int32_t)maxx, (int32_t)maxy);
   return true;
 }
 
-bool LoadLayoutNeededLayers(const std::string& layout_path, const RuleFile& rule, LayoutDB& out) {
-  std::ifstream fin(layout_path);
-  if (!fin) { std::cerr<<"Cannot open layout: "<<layout_path<<"\n"; return false; }
+ShapeKind ClassifyShape(const Point* pts, uint32_t n,
+                        int32_t minx, int32_t miny, int32_t maxx, int32_t maxy) {
+  for (uint32_t i=0;i<n;i++){
+    const Point& a = pts[i];
+    const Point& b = pts[(i+1)%n];
+    if (a.x!=b.x && a.y!=b.y) return kShapeGeneral;
+  }
+  // an explicitly closed ring repeats its first vertex
+  if (n==5 && pts[4].x==pts[0].x && pts[4].y==pts[0].y) n = 4;
+  if (n!=4) return kShapeManhattan;
+  // four axis-parallel edges on a line cover the whole segment
+  if (minx==maxx || miny==maxy) return kShapeRect;
+  // otherwise the four vertices must be the four distinct bbox corners
+  int corners = 0;
+  for (uint32_t i=0;i<4;i++){
+    bool cx = pts[i].x==minx || pts[i].x==maxx;
+    bool cy = pts[i].y==miny || pts[i].y==maxy;
+    if (!cx || !cy) return kShapeManhattan;
+    corners |= 1 << ((pts[i].x==maxx) | (pts[i].y==maxy)<<1);
+  }
+  return corners==15 ? kShapeRect : kShapeManhattan;
+}
+
+void LayerData::Append(const LayerData& o) {
+  uint64_t base = pts.size();
+  pts.insert(pts.end(), o.pts.begin(), o.pts.end());
+  offs.reserve(offs.size() + o.size());
+  for (size_t i=1; i<o.offs.size(); i++) offs.push_back(base + o.offs[i]);
+  minx.insert(minx.end(), o.minx.begin(), o.minx.end());
+  miny.insert(miny.end(), o.miny.begin(), o.miny.end());
+  maxx.insert(maxx.end(), o.maxx.begin(), o.maxx.end());
+  maxy.insert(maxy.end(), o.maxy.begin(), o.maxy.end());
+  shape.insert(shape.end(), o.shape.begin(), o.shape.end());
+}
+
+size_t LayoutDB::LayerSize(int id) const {
+  if (id < 0 || id >= (int)names.size()) return 0;
+  return source ? source->Size(id) : layers[id].size();
+}
+
+const LayerData& LayoutDB::Layer(int id) const {
+  static const LayerData kEmpty;
+  if (id < 0 || id >= (int)names.size()) return kEmpty;
+  return source ? source->Get(id) : layers[id];
+}
+
+size_t LayoutDB::NumParts() const { return NumLayers() + (hier ? hier->NumInstParts() : 0); }
+
+int LayoutDB::PartLayer(size_t part) const {
+  return part < NumLayers() ? (int)part : hier->PartLayer(part);
+}
+
+size_t LayoutDB::PartSize(size_t part) const {
+  return part < NumLayers() ? LayerSize((int)part) : hier->PartData(part).size();
+}
+
+const LayerData& LayoutDB::PartData(size_t part) const {
+  return part < NumLayers() ? Layer((int)part) : hier->PartData(part);
+}
+
+Transform LayoutDB::PartTransform(size_t part) const {
+  return part < NumLayers() ? Transform{} : hier->PartTransform(part);
+}
+
+// Keyword lines of a hierarchical layout:
+//   CELL <name>   ...   ENDCELL        defines a cell (layers and polygons)
+//   INST <cell> <x> <y> [orientation]  places a cell, at the top level or
+//                                      inside another cell's block
+// A file with any CELL or INST line is hierarchical. ENDCELL is a keyword
+// only inside a CELL block; elsewhere it is an ordinary layer header.
+static const char kEndCell[] = "ENDCELL";
+
+// Trimmed line [b,e) is a layer header (polygon lines always start with '(').
+static inline bool IsHeader(const char* b, const char* e) {
+  return *b != '(' && IsLayerLine(b, e);
+}
+
+// Trimmed line [b,e) is a CELL or INST line.
+static inline bool IsCellOrInst(const char* b, const char* e) {
+  return e - b > 4 && (b[4]==' '||b[4]=='\t') && (std::memcmp(b, "CELL", 4) == 0 || std::memcmp(b, "INST", 4) == 0);
+}
 
-  out.layers.clear();
-  std::string cur_layer;
-  bool keep=false;
+static bool BadLine(size_t line, const char* b, const char* e, const char* why) {
+  std::cerr << "Layout line " << line << ": " << why << ": " << std::string(b, e) << "\n";
+  return false;
+}
 
-  std::string line;
-  while (std::getline(fin, line)) {
-    line = Trim(line);
-    if (line.empty()) continue;
+// Parses a hierarchical layout in one pass: polygons outside CELL blocks go
+// to out.layers, those inside to the cell's masters; instances are only
+// recorded, then numbered into parts by Hierarchy::Resolve().
+static bool LoadLayoutHier(const MappedFile& mf, const LayerTable& table, LayoutDB& out) {
+  out.names = table.names;
+  out.layers.assign(out.names.size(), LayerData{});
+  out.source.reset();
+  auto hier = std::make_shared<Hierarchy>(out.names.size());
 
-    if (IsLayerLine(line)) {
-      cur_layer = line;
-      keep = (rule.needed_layers.find(cur_layer) != rule.needed_layers.end());
-      if (keep && out.layers.find(cur_layer)==out.layers.end()) out.layers[cur_layer]=LayerData{};
+  const char* p = mf.data();
+  const char* end = p + mf.size();
+  int cell = -1, cur_id = -1;
+  for (size_t line = 1; p < end; line++) {
+    const char* eol = (const char*)std::memchr(p, '\n', end-p);
+    if (!eol) eol = end;
+    const char* b = p;
+    const char* e = eol;
+    p = eol + (eol < end ? 1 : 0);
+
+    TrimRange(b, e);
+    if (b == e) continue;
+    if (cell >= 0 && std::string_view(b, e-b) == kEndCell) {
+      cell = cur_id = -1;
       continue;
     }
+    if (IsHeader(b, e)) { cur_id = table.Find(std::string(b, e)); continue; }
+    auto toks = *b == '(' ? std::vector<std::string>{} : SplitWS(std::string(b, e));
+    if (toks.empty() || (toks[0] != "CELL" && toks[0] != "INST")) {
+      if (cur_id >= 0) ParsePolyLine(b, e, cell < 0 ? out.layers[cur_id] : hier->MasterLayer(cell, cur_id));
+      continue;
+    }
+    if (toks[0] == "CELL" && toks.size() == 2) {
+      if (cell >= 0) return BadLine(line, b, e, "cell definitions cannot nest");
+      cell = hier->CellId(toks[1]);
+      cur_id = -1;
+      if (!hier->Define(cell)) return BadLine(line, b, e, "cell defined twice");
+    } else if (toks[0] == "INST" && (toks.size() == 4 || toks.size() == 5)) {
+      Transform t;
+      int64_t x, y;
+      const char* xe = toks[2].data() + toks[2].size();
+      const char* ye = toks[3].data() + toks[3].size();
+      if (ParseInt(toks[2].data(), xe, x) != xe || ParseInt(toks[3].data(), ye, y) != ye) {
+        return BadLine(line, b, e, "bad instance offset");
+      }
+      if (toks.size() == 5 && !ParseOrientation(toks[4], t)) return BadLine(line, b, e, "unknown orientation");
+      t.dx = (int32_t)x;
+      t.dy = (int32_t)y;
+      hier->AddInstance(cell, hier->CellId(toks[1]), t);
+    } else {
+      return BadLine(line, b, e, "wrong number of fields");
+    }
+  }
+  if (cell >= 0) { std::cerr << "Layout ends inside a CELL block\n"; return false; }
+  if (!hier->Resolve()) return false;
+
+  std::cerr << "[HIER] cells=" << hier->NumCells() << " placements=" << hier->NumPlacements()
+            << " parts=" << hier->NumInstParts() << " master_polys=" << hier->MasterPolys()
+            << " placed_polys=" << hier->PlacedPolys() << "\n";
+  out.hier = std::move(hier);
+  return true;
+}
+
+// Layer named by the last header line in [b,e), scanning backwards from e.
+// Returns false if the range has no header.
+static bool LastHeaderIn(const char* b, const char* e, std::string& name) {
+  const char* le = e;
+  while (le > b) {
+    const char* ls = le;
+    while (ls > b && ls[-1] != '\n') --ls;
+    const char* tb = ls;
+    const char* te = le;
+    TrimRange(tb, te);
+    if (tb != te && IsHeader(tb, te)) { name.assign(tb, te); return true; }
+    le = ls > b ? ls - 1 : b;
+  }
+  return false;
+}
 
-    if (keep && !cur_layer.empty()) {
-      Polygon p;
-      if (ParsePolyLine(line, p)) out.layers[cur_layer].polys.push_back(std::move(p));
+// Scans [p,end) line by line in place, starting inside layer `cur_id`.
+// Lines of layers the rule does not need are skipped after a single
+// memchr for the line end. A CELL or INST line sets `hier` and every range
+// stops, since a hierarchical layout is parsed by LoadLayoutHier instead.
+static void ParseRange(const char* p, const char* end, int cur_id,
+                       const LayerTable& table, std::vector<LayerData>& out,
+                       std::atomic<bool>& hier) {
+  while (p < end && !hier.load(std::memory_order_relaxed)) {
+    const char* eol = (const char*)std::memchr(p, '\n', end-p);
+    if (!eol) eol = end;
+    const char* b = p;
+    const char* e = eol;
+    p = eol + (eol < end ? 1 : 0);
+
+    TrimRange(b, e);
+    if (b == e) continue;
+
+    if (IsHeader(b, e)) {
+      cur_id = table.Find(std::string(b, e));
+      continue;
     }
+    if (*b != '(' && IsCellOrInst(b, e)) {
+      hier.store(true, std::memory_order_relaxed);
+      return;
+    }
+
+    if (cur_id >= 0) ParsePolyLine(b, e, out[cur_id]);
+  }
+}
+
+// Header names of [b,e) in file order; `hier` is set if the range has a
+// CELL or INST line.
+static void HeadersIn(const char* b, const char* e, std::vector<std::string>& names, char& hier) {
+  while (b < e) {
+    const char* eol = (const char*)std::memchr(b, '\n', e-b);
+    if (!eol) eol = e;
+    const char* tb = b;
+    const char* te = eol;
+    b = eol + (eol < e ? 1 : 0);
+    TrimRange(tb, te);
+    if (tb == te) continue;
+    if (IsHeader(tb, te)) names.emplace_back(tb, te);
+    else if (*tb != '(' && IsCellOrInst(tb, te)) hier = 1;
+  }
+}
+
+// Below this size a single pass beats the chunking overhead.
+static const size_t kMinParallelBytes = 4u << 20;
+
+// Splits [data,data+size) into about `n` ranges that each start at a line start.
+static std::vector<const char*> ChunkCuts(const char* data, size_t size, size_t n) {
+  const char* end = data + size;
+  std::vector<const char*> cut(n + 1, end);
+  cut[0] = data;
+  for (size_t c=1; c<n; c++) {
+    const char* p = std::max(cut[c-1], data + size / n * c);
+    const char* nl = (const char*)std::memchr(p, '\n', end-p);
+    cut[c] = nl ? nl + 1 : end;
+  }
+  return cut;
+}
+
+// The file is cut into byte ranges at line starts and the ranges are parsed
+// concurrently into per-chunk LayerData. A chunk that begins mid-layer takes
+// its layer from the last header of the chunks before it. Chunks are then
+// appended in file order, so polygon indices match a sequential load.
+// Sets `hier` and leaves `out` unfilled if the layout is hierarchical.
+static size_t LoadLayoutText(const MappedFile& mf, const LayerTable& table,
+                             int threads, LayoutDB& out, bool& hier) {
+  out.names = table.names;
+  out.layers.assign(out.names.size(), LayerData{});
+  out.source.reset();
+  out.hier.reset();
+
+  const char* data = mf.data();
+  const char* end = data + mf.size();
+  size_t nchunks = 1;
+  if (threads > 1 && mf.size() >= kMinParallelBytes) nchunks = (size_t)threads * 4;
+
+  std::atomic<bool> found_hier{false};
+  if (nchunks == 1) {
+    ParseRange(data, end, -1, table, out.layers, found_hier);
+    hier = found_hier;
+    return nchunks;
+  }
+
+  auto cut = ChunkCuts(data, mf.size(), nchunks);
+
+  // layer each chunk ends in, if it contains a header at all
+  std::vector<std::string> last(nchunks);
+  std::vector<char> has_last(nchunks, 0);
+  ParallelFor(threads, nchunks, 1, [&](size_t b, size_t e, int){
+    for (size_t c=b; c<e; c++) has_last[c] = LastHeaderIn(cut[c], cut[c+1], last[c]);
+  });
+  std::vector<int> start_id(nchunks, -1);
+  for (size_t c=1; c<nchunks; c++) {
+    start_id[c] = has_last[c-1] ? table.Find(last[c-1]) : start_id[c-1];
+  }
+
+  std::vector<std::vector<LayerData>> parts(nchunks, std::vector<LayerData>(out.layers.size()));
+  ParallelFor(threads, nchunks, 1, [&](size_t b, size_t e, int){
+    for (size_t c=b; c<e; c++) ParseRange(cut[c], cut[c+1], start_id[c], table, parts[c], found_hier);
+  });
+  hier = found_hier;
+  if (hier) return nchunks;
+
+  ParallelFor(threads, out.layers.size(), 1, [&](size_t b, size_t e, int){
+    for (size_t id=b; id<e; id++) {
+      size_t np = 0, nv = 0;
+      for (auto& part: parts) { np += part[id].size(); nv += part[id].pts.size(); }
+      auto& dst = out.layers[id];
+      dst.pts.reserve(nv);
+      dst.offs.reserve(np + 1);
+      dst.minx.reserve(np); dst.miny.reserve(np); dst.maxx.reserve(np); dst.maxy.reserve(np);
+      dst.shape.reserve(np);
+      for (auto& part: parts) {
+        dst.Append(part[id]);
+        part[id] = LayerData{};
+      }
+    }
+  });
+  return nchunks;
+}
+
+static void LogLoad(const char* kind, size_t bytes, size_t chunks,
+                    std::chrono::steady_clock::time_point t0) {
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cerr << "[LOAD] " << kind << " bytes=" << bytes << " chunks=" << chunks << " ms=" << sec*1000.0
+            << " MB/s=" << (sec > 0 ? bytes / 1e6 / sec : 0.0) << "\n";
+}
+
+bool LoadLayoutNeededLayers(const std::string& layout_path, const RuleFile& rule,
+                            int threads, LayoutDB& out) {
+  auto t0 = std::chrono::steady_clock::now();
+  auto mf = std::make_shared<MappedFile>();
+  if (!mf->Open(layout_path)) { std::cerr<<"Cannot open layout: "<<layout_path<<"\n"; return false; }
+
+  if (IsLayoutCache(*mf)) {
+    if (!LoadLayoutCache(mf, rule.layers, out)) return false;
+    LogLoad("cache", mf->size(), 1, t0);
+    return true;
+  }
+  bool hier = false;
+  size_t nchunks = LoadLayoutText(*mf, rule.layers, threads, out, hier);
+  if (hier) {
+    if (!LoadLayoutHier(*mf, rule.layers, out)) return false;
+    LogLoad("hier", mf->size(), 1, t0);
+    return true;
+  }
+  LogLoad("text", mf->size(), nchunks, t0);
+  return true;
+}
+
+bool LoadLayoutAllLayers(const std::string& layout_path, int threads, LayoutDB& out) {
+  auto t0 = std::chrono::steady_clock::now();
+  auto mf = std::make_shared<MappedFile>();
+  if (!mf->Open(layout_path)) { std::cerr<<"Cannot open layout: "<<layout_path<<"\n"; return false; }
+  if (IsLayoutCache(*mf)) {
+    std::vector<std::string> names;
+    if (!LayoutCacheLayerNames(*mf, names)) return false;
+    LayerTable table;
+    for (auto& n: names) table.Intern(n);
+    if (!LoadLayoutCache(mf, table, out)) return false;
+    LogLoad("cache", mf->size(), 1, t0);
+    return true;
+  }
+
+  // every header in file order, so IDs follow first appearance
+  size_t nscan = std::max<size_t>(1, (size_t)threads);
+  auto cut = ChunkCuts(mf->data(), mf->size(), nscan);
+  std::vector<std::vector<std::string>> found(nscan);
+  std::vector<char> found_hier(nscan, 0);
+  ParallelFor(threads, nscan, 1, [&](size_t b, size_t e, int){
+    for (size_t c=b; c<e; c++) HeadersIn(cut[c], cut[c+1], found[c], found_hier[c]);
+  });
+  LayerTable table;
+  for (auto& names: found) for (auto& n: names) table.Intern(n);
+
+  if (std::count(found_hier.begin(), found_hier.end(), 1)) {
+    if (!LoadLayoutHier(*mf, table, out)) return false;
+    LogLoad("hier", mf->size(), 1, t0);
+    return true;
   }
+  bool hier = false; // already known flat
+  size_t nchunks = LoadLayoutText(*mf, table, threads, out, hier);
+  LogLoad("text", mf->size(), nchunks, t0);
   return true;
 }
 
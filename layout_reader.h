@@ -1,5 +1,6 @@
 // src/layout_reader.h
 #pragma once
+#include <memory>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -7,15 +8,129 @@
 
 namespace tracer {
 
-struct Polygon {
-  std::vector<Point> pts;  // CCW
+// Shape class tagged at load time so geometry tests can pick a kernel.
+enum ShapeKind : uint8_t {
+  kShapeGeneral = 0,    // has a non axis-parallel edge
+  kShapeManhattan = 1,  // all edges axis-parallel
+  kShapeRect = 2,       // Manhattan and equal to its bbox
+};
+
+ShapeKind ClassifyShape(const Point* pts, uint32_t n,
+                        int32_t minx, int32_t miny, int32_t maxx, int32_t maxy);
+
+// Read-only view of one polygon stored in a LayerData.
+struct PolyView {
+  const Point* pts = nullptr;  // CCW
+  uint32_t n = 0;
   int32_t minx=0, miny=0, maxx=0, maxy=0;
+  uint8_t shape = kShapeGeneral;
+};
+
+// Manhattan placement: (x,y) -> (a*x + b*y + dx, c*x + d*y + dy) with an
+// orthogonal {a,b,c,d} of 0/+-1 entries (a rotation by a multiple of 90
+// degrees, optionally after a mirror).
+struct Transform {
+  int32_t a=1, b=0, c=0, d=1;
+  int32_t dx=0, dy=0;
+
+  Point Apply(const Point& p) const {
+    return Point{(int32_t)((int64_t)a*p.x + (int64_t)b*p.y + dx),
+                 (int32_t)((int64_t)c*p.x + (int64_t)d*p.y + dy)};
+  }
+  bool Mirrored() const { return a*d - b*c < 0; }
+  Transform Inverse() const {
+    // the inverse of an orthogonal matrix is its transpose
+    Transform t{a, c, b, d, 0, 0};
+    Point o = t.Apply(Point{dx, dy});
+    t.dx = -o.x; t.dy = -o.y;
+    return t;
+  }
+  // this, then `outer`
+  Transform Then(const Transform& o) const {
+    Transform t{o.a*a + o.b*c, o.a*b + o.b*d, o.c*a + o.d*c, o.c*b + o.d*d, 0, 0};
+    Point p = o.Apply(Point{dx, dy});
+    t.dx = p.x; t.dy = p.y;
+    return t;
+  }
+};
+
+// Polygons of one layer as struct-of-arrays: polygon i owns vertices
+// pts[offs[i], offs[i+1]) and bbox (minx[i], miny[i], maxx[i], maxy[i]).
+struct LayerData {
+  std::vector<Point> pts;
+  std::vector<uint64_t> offs = {0};
+  std::vector<int32_t> minx, miny, maxx, maxy;
+  std::vector<uint8_t> shape;  // ShapeKind
+
+  size_t size() const { return minx.size(); }
+  bool empty() const { return minx.empty(); }
+  PolyView Poly(size_t i) const {
+    return PolyView{pts.data() + offs[i], (uint32_t)(offs[i+1] - offs[i]),
+                    minx[i], miny[i], maxx[i], maxy[i], shape[i]};
+  }
+  // Closes the polygon made of the vertices pushed since the last call.
+  void EndPoly(int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+    uint64_t b = offs.back();
+    shape.push_back(ClassifyShape(pts.data() + b, (uint32_t)(pts.size() - b), x0, y0, x1, y1));
+    offs.push_back(pts.size());
+    minx.push_back(x0); miny.push_back(y0); maxx.push_back(x1); maxy.push_back(y1);
+  }
+  // Drops vertices pushed since the last EndPoly.
+  void AbortPoly() { pts.resize(offs.back()); }
+  // Appends all polygons of `o` after ours, keeping their order.
+  void Append(const LayerData& o);
 };
 
-struct LayerData { std::vector<Polygon> polys; };
+class Hierarchy;
+
+// Layers a LayoutDB reads on first use instead of at load time.
+class LayerSource {
+public:
+  virtual ~LayerSource() = default;
+  virtual size_t Size(int id) const = 0;            // polygon count, without reading
+  virtual const LayerData& Get(int id) const = 0;   // reads once; thread-safe
+  // false once a layer turned out corrupt on reading (Get() gave it empty)
+  virtual bool Ok() const { return true; }
+};
+
+// Layers indexed by the rule's LayerTable IDs; layers absent from the
+// layout file are present but empty. A text layout is parsed into
+// `layers` up front; a cached one leaves `layers` empty and each layer is
+// copied out of the cache the first time Layer() asks for it.
+//
+// A hierarchical layout (hierarchy.h) keeps its top-level polygons in
+// `layers` and its cell masters, unflattened, in `hier`. The geometry is
+// then split into parts: part id < NumLayers() is the top level of that
+// layer, every other part is one layer of one placed cell instance. A
+// part's polygons are stored once per master, in the cell's coordinates;
+// PartTransform() maps them to the layout's. Flat layouts have exactly one
+// part per layer, with the identity transform.
+struct LayoutDB {
+  std::vector<std::string> names; // id -> name
+  std::vector<LayerData> layers;  // id -> polygons, unless `source` is set
+  std::shared_ptr<const LayerSource> source;
+  std::shared_ptr<const Hierarchy> hier;  // null for a flat layout
+  size_t NumLayers() const { return names.size(); }
+  size_t LayerSize(int id) const;
+  const LayerData& Layer(int id) const;
+  // false if a layer read on first use was corrupt; results are then wrong
+  bool LayersOk() const { return !source || source->Ok(); }
+
+  size_t NumParts() const;
+  int PartLayer(size_t part) const;
+  size_t PartSize(size_t part) const;
+  const LayerData& PartData(size_t part) const;  // in the master's coordinates
+  Transform PartTransform(size_t part) const;
+};
 
-struct LayoutDB { std::unordered_map<std::string, LayerData> layers; };
+// Loads only the layers named in `rule`, parsing with up to `threads` workers.
+bool LoadLayoutNeededLayers(const std::string& layout_path, const RuleFile& rule,
+                            int threads, LayoutDB& out);
+// `layout_path` may be a text layout, flat or hierarchical, or a binary
+// cache (layout_cache.h).
 
-bool LoadLayoutNeededLayers(const std::string& layout_path, const RuleFile& rule, LayoutDB& out);
+// Loads every layer, IDs in order of first appearance (text) or of the
+// cache's table of contents.
+bool LoadLayoutAllLayers(const std::string& layout_path, int threads, LayoutDB& out);
 
 } // namespace tracer
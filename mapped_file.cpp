@@ -0,0 +1,97 @@
+// src/mapped_file.cpp
+#include "mapped_file.h"
+#include <algorithm>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tracer {
+
+MappedFile::~MappedFile() { Close(); }
+
+static const size_t kPageBytes = 4096;
+
+// Whole pages of [offset, offset+len) within a map at `base`; false if none.
+static bool InnerPages(const char* base, size_t size, size_t offset, size_t len,
+                       char*& b, size_t& n) {
+  if (!base || offset >= size) return false;
+  uintptr_t lo = (uintptr_t)base + offset;
+  uintptr_t hi = (uintptr_t)base + std::min(size, offset + len);
+  lo = (lo + kPageBytes - 1) & ~(uintptr_t)(kPageBytes - 1);
+  hi &= ~(uintptr_t)(kPageBytes - 1);
+  if (hi <= lo) return false;
+  b = (char*)lo; n = hi - lo;
+  return true;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string& path) {
+  Close();
+  HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (f == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER sz;
+  if (!GetFileSizeEx(f, &sz)) { CloseHandle(f); return false; }
+  file_ = f;
+  size_ = (size_t)sz.QuadPart;
+  if (size_ == 0) return true;
+  HANDLE m = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!m) { Close(); return false; }
+  mapping_ = m;
+  data_ = (const char*)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+  if (!data_) { Close(); return false; }
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_) UnmapViewOfFile(data_);
+  if (mapping_) CloseHandle((HANDLE)mapping_);
+  if (file_) CloseHandle((HANDLE)file_);
+  data_ = nullptr; mapping_ = nullptr; file_ = nullptr; size_ = 0;
+}
+
+void MappedFile::Release(size_t offset, size_t len) const {
+  char* b; size_t n;
+  // unlocking pages that are not locked removes them from the working set
+  if (InnerPages(data_, size_, offset, len, b, n)) VirtualUnlock(b, n);
+}
+
+#else
+
+bool MappedFile::Open(const std::string& path) {
+  Close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (::fstat(fd, &st) != 0) { ::close(fd); return false; }
+  size_ = (size_t)st.st_size;
+  if (size_ == 0) { ::close(fd); return true; }
+  void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) { size_ = 0; return false; }
+  ::madvise(p, size_, MADV_SEQUENTIAL);
+  data_ = (const char*)p;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_) ::munmap((void*)data_, size_);
+  data_ = nullptr; size_ = 0;
+}
+
+void MappedFile::Release(size_t offset, size_t len) const {
+  char* b; size_t n;
+  if (InnerPages(data_, size_, offset, len, b, n)) ::madvise(b, n, MADV_DONTNEED);
+}
+
+#endif
+
+} // namespace tracer
@@ -0,0 +1,33 @@
+// src/mapped_file.h
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace tracer {
+
+// Read-only memory map of a whole file. An empty file maps to size()==0.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool Open(const std::string& path);
+  void Close();
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  // Drops the whole pages inside [offset, offset+len) from the process's
+  // resident set; they are read from the file again if touched.
+  void Release(size_t offset, size_t len) const;
+
+private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  void* file_ = nullptr;
+  void* mapping_ = nullptr;
+#endif
+};
+
+} // namespace tracer
@@ -1,126 +1,257 @@
 // src/ortho_rect.cpp
 #include "ortho_rect.h"
 #include <algorithm>
-#include <unordered_map>
-#include <set>
+#include <array>
 
 namespace tracer {
 
-// ---- polygon -> rects (scan by unique y) ----
-static void CollectUniqueY(const Polygon& p, std::vector<int32_t>& ys) {
-  ys.clear();
-  ys.reserve(p.pts.size());
-  for (auto& pt: p.pts) ys.push_back(pt.y);
-  std::sort(ys.begin(), ys.end());
-  ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+// ---- polygon -> rects (one y sweep over the vertical edges) ----
+// Slab merge shared by both sweeps: an interval in `cur` equal to one in
+// `open` keeps that rect open (its start coordinate moves across); every
+// other open interval is closed at `at`. With y_spans the intervals are
+// y-ranges swept along x, otherwise x-ranges swept along y.
+static void MergeSlab(
+  std::pmr::vector<std::pair<int32_t,int32_t>>& open, std::pmr::vector<int32_t>& open_at,
+  std::pmr::vector<std::pair<int32_t,int32_t>>& cur, std::pmr::vector<int32_t>& cur_at,
+  int32_t at, bool y_spans, RectVec& out
+) {
+  cur_at.assign(cur.size(), at);
+  size_t k = 0;
+  for (size_t j=0; j<open.size(); j++) {
+    while (k < cur.size() && cur[k] < open[j]) k++;
+    if (k < cur.size() && cur[k] == open[j]) cur_at[k] = open_at[j];
+    else if (y_spans) out.push_back(Rect{open_at[j], open[j].first, at, open[j].second});
+    else out.push_back(Rect{open[j].first, open_at[j], open[j].second, at});
+  }
+  open.swap(cur);
+  open_at.swap(cur_at);
 }
 
-static std::vector<int32_t> XCrossingsAtY(const Polygon& p, int32_t y) {
-  std::vector<int32_t> xs;
-  const auto& P = p.pts;
-  int n=(int)P.size();
-  for (int i=0;i<n;i++){
-    auto a=P[i], b=P[(i+1)%n];
-    if (a.y==b.y) continue; // ignore horizontal
-    int32_t y1=a.y, y2=b.y;
-    int32_t x1=a.x, x2=b.x;
-    if (y1>y2) { std::swap(y1,y2); std::swap(x1,x2); }
-    if (y<=y1 || y>y2) continue; // (y1,y2]
-    // vertical edge => x constant
-    xs.push_back(x1);
+// Per-thread and reused across calls, so it stays on the default resource.
+struct DecomposeScratch {
+  struct VEdge { int32_t y, x; int delta; }; // x enters (+1) or leaves (-1) the active set at y
+  std::vector<VEdge> ev;
+  std::vector<int32_t> active, next;         // sorted x of the edges spanning the current slab
+  std::vector<int32_t> adds, dels;
+  std::pmr::vector<std::pair<int32_t,int32_t>> open, cur;
+  std::pmr::vector<int32_t> open_y, cur_y;
+};
+
+void DecomposeToRects(const PolyView& poly, RectVec& rects) {
+  static thread_local DecomposeScratch sc;
+  sc.ev.clear();
+  sc.active.clear();
+  sc.open.clear();
+  sc.open_y.clear();
+
+  // Any non-horizontal edge spans [ylo, yhi) at the x of its lower end
+  // (exact for Manhattan polygons).
+  const Point* P = poly.pts;
+  for (uint32_t i=0;i<poly.n;i++){
+    Point a=P[i], b=P[(i+1)%poly.n];
+    if (a.y==b.y) continue;
+    if (a.y>b.y) std::swap(a,b);
+    sc.ev.push_back(DecomposeScratch::VEdge{a.y, a.x, +1});
+    sc.ev.push_back(DecomposeScratch::VEdge{b.y, a.x, -1});
   }
-  std::sort(xs.begin(), xs.end());
-  return xs;
-}
+  std::sort(sc.ev.begin(), sc.ev.end(), [](const DecomposeScratch::VEdge& a, const DecomposeScratch::VEdge& b){
+    return a.y != b.y ? a.y < b.y : a.x < b.x;
+  });
 
-std::vector<Rect> DecomposeToRects(const Polygon& poly) {
-  std::vector<Rect> rects;
-  std::vector<int32_t> ys;
-  CollectUniqueY(poly, ys);
-  if (ys.size()<2) return rects;
-
-  for (size_t i=0;i+1<ys.size();i++){
-    int32_t y0=ys[i], y1=ys[i+1];
-    if (y0==y1) continue;
-    int32_t ymid = y0 + (y1-y0)/2;
-    auto xs = XCrossingsAtY(poly, ymid);
-    for (size_t k=0;k+1<xs.size();k+=2){
-      int32_t x0=xs[k], x1c=xs[k+1];
-      if (x0>x1c) std::swap(x0,x1c);
-      if (x0==x1c) continue;
-      rects.push_back(Rect{x0,y0,x1c,y1});
+  for (size_t i=0; i<sc.ev.size(); ) {
+    // apply all edges starting/ending at y in one merge pass (they come
+    // sorted by x), so wide slabs with many jogs stay linear
+    int32_t y = sc.ev[i].y;
+    sc.adds.clear();
+    sc.dels.clear();
+    for (; i<sc.ev.size() && sc.ev[i].y == y; i++) {
+      (sc.ev[i].delta > 0 ? sc.adds : sc.dels).push_back(sc.ev[i].x);
+    }
+    sc.next.clear();
+    size_t ia = 0, id = 0;
+    for (int32_t x: sc.active) {
+      while (id < sc.dels.size() && sc.dels[id] < x) id++;
+      if (id < sc.dels.size() && sc.dels[id] == x) { id++; continue; }
+      while (ia < sc.adds.size() && sc.adds[ia] < x) sc.next.push_back(sc.adds[ia++]);
+      sc.next.push_back(x);
     }
+    sc.next.insert(sc.next.end(), sc.adds.begin() + ia, sc.adds.end());
+    sc.active.swap(sc.next);
+    // even-odd pairs of the active edges, touching spans joined
+    sc.cur.clear();
+    for (size_t k=0;k+1<sc.active.size();k+=2){
+      int32_t x0=sc.active[k], x1=sc.active[k+1];
+      if (x0==x1) continue;
+      if (!sc.cur.empty() && sc.cur.back().second==x0) sc.cur.back().second = x1;
+      else sc.cur.emplace_back(x0, x1);
+    }
+    MergeSlab(sc.open, sc.open_y, sc.cur, sc.cur_y, y, false, rects);
   }
-  return rects;
+  // the active set is empty after the last event, closing every rect
 }
 
-// ---- rect difference A - B (simple splitting) ----
-static inline bool RectOverlap(const Rect& a, const Rect& b) {
-  return !(a.x2<=b.x1 || b.x2<=a.x1 || a.y2<=b.y1 || b.y2<=a.y1);
+// ---- rect booleans (x scanline over a y segment tree) ----
+// A y position is in one of four states c = a | b<<1 (a: covered by A,
+// b: covered by B); an op is the 4-bit truth table over c.
+static uint8_t TruthTable(RectBoolOp op) {
+  switch (op) {
+    case RectBoolOp::Union:      return 0xE; // c = 1,2,3
+    case RectBoolOp::Intersect:  return 0x8; // c = 3
+    case RectBoolOp::Difference: return 0x2; // c = 1
+    case RectBoolOp::Xor:        return 0x6; // c = 1,2
+  }
+  return 0;
 }
 
-static std::vector<Rect> SubtractOne(const Rect& a, const Rect& b) {
-  // returns pieces of a after removing intersection with b
-  if (!RectOverlap(a,b)) return {a};
-  int32_t ix1=std::max(a.x1,b.x1), iy1=std::max(a.y1,b.y1);
-  int32_t ix2=std::min(a.x2,b.x2), iy2=std::min(a.y2,b.y2);
-  if (ix1>=ix2 || iy1>=iy2) return {a};
-
-  std::vector<Rect> out;
-  // top
-  if (iy2 < a.y2) out.push_back(Rect{a.x1,iy2,a.x2,a.y2});
-  // bottom
-  if (a.y1 < iy1) out.push_back(Rect{a.x1,a.y1,a.x2,iy1});
-  // left
-  if (a.x1 < ix1) out.push_back(Rect{a.x1,iy1,ix1,iy2});
-  // right
-  if (ix2 < a.x2) out.push_back(Rect{ix2,iy1,a.x2,iy2});
+// Set of states `mask` after forcing a (fa) and/or b (fb) to covered.
+static inline uint8_t ForceCover(uint8_t mask, bool fa, bool fb) {
+  uint8_t out = 0;
+  for (int c=0;c<4;c++) {
+    if (!(mask>>c & 1)) continue;
+    int a = (c&1) | (int)fa, b = (c>>1&1) | (int)fb;
+    out |= (uint8_t)(1 << (a | b<<1));
+  }
   return out;
 }
 
-std::vector<Rect> RectDifference(const std::vector<Rect>& A, const std::vector<Rect>& B) {
-  std::vector<Rect> cur = A;
-  for (auto& b : B) {
-    std::vector<Rect> next;
-    for (auto& a : cur) {
-      auto pieces = SubtractOne(a,b);
-      next.insert(next.end(), pieces.begin(), pieces.end());
+// Cover counts over the elementary intervals [ys[i], ys[i+1]). As in the
+// classic area-of-union tree, a range add stops at canonical nodes and is
+// never pushed down; occ[] is the set of states present in a subtree given
+// the subtree's own counts, so the intervals where an op holds are read
+// off in O((out + 1) log n).
+class BoolSegTree {
+public:
+  BoolSegTree(const std::pmr::vector<int32_t>& ys, std::pmr::memory_resource* mr)
+    : ys_(ys), n_((int)ys.size()-1), cnt_(4*n_, {0,0}, mr), occ_(4*n_, 1, mr) {}
+
+  void Add(int set, int l, int r, int delta) { Add(1, 0, n_, set, l, r, delta); }
+
+  // Appends the maximal y-intervals where `tt` holds.
+  void Collect(uint8_t tt, std::pmr::vector<std::pair<int32_t,int32_t>>& out) const {
+    Collect(1, 0, n_, false, false, tt, out);
+  }
+
+private:
+  void Add(int node, int nl, int nr, int set, int l, int r, int delta) {
+    if (r <= nl || nr <= l) return;
+    if (l <= nl && nr <= r) cnt_[node][set] += delta;
+    else {
+      int mid = (nl + nr) / 2;
+      Add(2*node, nl, mid, set, l, r, delta);
+      Add(2*node+1, mid, nr, set, l, r, delta);
     }
-    cur.swap(next);
-    if (cur.empty()) break;
+    uint8_t below = nr - nl == 1 ? 1 : (uint8_t)(occ_[2*node] | occ_[2*node+1]);
+    occ_[node] = ForceCover(below, cnt_[node][0] > 0, cnt_[node][1] > 0);
   }
-  // remove degenerate
-  std::vector<Rect> out;
-  out.reserve(cur.size());
-  for (auto& r: cur) if (r.x1<r.x2 && r.y1<r.y2) out.push_back(r);
-  return out;
-}
 
-// ---- rects -> boundary polygons (edge cancel + loop trace) ----
-struct Edge { int32_t x1,y1,x2,y2;
-  bool operator<(const Edge& o) const {
-    if (x1!=o.x1) return x1<o.x1;
-    if (y1!=o.y1) return y1<o.y1;
-    if (x2!=o.x2) return x2<o.x2;
-    return y2<o.y2;
+  void Collect(int node, int nl, int nr, bool fa, bool fb, uint8_t tt,
+               std::pmr::vector<std::pair<int32_t,int32_t>>& out) const {
+    uint8_t eff = ForceCover(occ_[node], fa, fb);
+    if (!(eff & tt)) return;
+    if (!(eff & ~tt & 0xF)) {
+      if (!out.empty() && out.back().second == ys_[nl]) out.back().second = ys_[nr];
+      else out.emplace_back(ys_[nl], ys_[nr]);
+      return;
+    }
+    fa = fa || cnt_[node][0] > 0;
+    fb = fb || cnt_[node][1] > 0;
+    int mid = (nl + nr) / 2;
+    Collect(2*node, nl, mid, fa, fb, tt, out);
+    Collect(2*node+1, mid, nr, fa, fb, tt, out);
   }
+
+  const std::pmr::vector<int32_t>& ys_;
+  int n_;
+  std::pmr::vector<std::array<int32_t,2>> cnt_;
+  std::pmr::vector<uint8_t> occ_;
 };
 
-static void AddOrCancel(std::multiset<Edge>& edges, const Edge& e) {
-  Edge rev{e.x2,e.y2,e.x1,e.y1};
-  auto it = edges.find(rev);
-  if (it!=edges.end()) edges.erase(it);
-  else edges.insert(e);
+void RectBoolean(const RectVec& A, const RectVec& B, RectBoolOp op, RectVec& out) {
+  std::pmr::memory_resource* mr = out.get_allocator().resource();
+  struct Event { int32_t x; int set; int delta; int32_t y1, y2; };
+  std::pmr::vector<Event> ev(mr);
+  std::pmr::vector<int32_t> ys(mr);
+  ev.reserve(2 * (A.size() + B.size()));
+  ys.reserve(2 * (A.size() + B.size()));
+  auto add = [&](const RectVec& rs, int set) {
+    for (auto& r: rs) {
+      if (r.x1 >= r.x2 || r.y1 >= r.y2) continue;
+      ev.push_back(Event{r.x1, set, +1, r.y1, r.y2});
+      ev.push_back(Event{r.x2, set, -1, r.y1, r.y2});
+      ys.push_back(r.y1);
+      ys.push_back(r.y2);
+    }
+  };
+  add(A, 0);
+  add(B, 1);
+  out.clear();
+  if (ev.empty()) return;
+  std::sort(ys.begin(), ys.end());
+  ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+  std::sort(ev.begin(), ev.end(), [](const Event& a, const Event& b){ return a.x < b.x; });
+  auto yi = [&](int32_t y){ return (int)(std::lower_bound(ys.begin(), ys.end(), y) - ys.begin()); };
+
+  const uint8_t tt = TruthTable(op);
+  BoolSegTree tree(ys, mr);
+  // intervals of the previous slab, each with the x where its rect opened
+  std::pmr::vector<std::pair<int32_t,int32_t>> open(mr), cur(mr);
+  std::pmr::vector<int32_t> open_x(mr), cur_x(mr);
+
+  for (size_t i=0; i<ev.size(); ) {
+    int32_t x = ev[i].x;
+    for (; i<ev.size() && ev[i].x == x; i++) tree.Add(ev[i].set, yi(ev[i].y1), yi(ev[i].y2), ev[i].delta);
+
+    cur.clear();
+    tree.Collect(tt, cur);
+    MergeSlab(open, open_x, cur, cur_x, x, true, out);
+  }
+  // every rect closes at the last event, where coverage is empty
 }
 
-static std::vector<std::vector<Point>> TraceLoops(std::multiset<Edge>& edges) {
-  using Key=uint64_t;
-  auto pack=[&](int32_t x,int32_t y)->Key{ return (uint64_t)(uint32_t)x<<32 | (uint32_t)y; };
+void RectDifference(const RectVec& A, const RectVec& B, RectVec& out) {
+  RectBoolean(A, B, RectBoolOp::Difference, out);
+}
 
-  std::unordered_map<Key, std::vector<Edge>> adj;
-  adj.reserve(edges.size()*2);
-  for (auto& e: edges) adj[pack(e.x1,e.y1)].push_back(e);
+// ---- rects -> boundary polygons (edge cancel + loop trace) ----
+struct Edge { int32_t x1,y1,x2,y2; };
+
+// One signed piece of rect boundary on an axis-parallel line: +1 runs
+// toward increasing coordinate, -1 back.
+struct LineEvent { int32_t line, pos; int delta; };
 
+// Cancels opposite boundary pieces by sorting instead of matching whole
+// edges: on every line the signed cover of its pieces is swept, and each
+// maximal run of nonzero cover becomes one directed edge. Partial overlaps
+// (T-junctions between rects of different sizes) cancel exactly and
+// collinear pieces come out merged. horizontal: line = y, pos = x.
+static void CancelOnLines(std::pmr::vector<LineEvent>& ev, bool horizontal, std::pmr::vector<Edge>& out) {
+  std::sort(ev.begin(), ev.end(), [](const LineEvent& a, const LineEvent& b){
+    return a.line != b.line ? a.line < b.line : a.pos < b.pos;
+  });
+  auto emit = [&](int32_t line, int32_t a, int32_t b, int sign) {
+    if (sign < 0) std::swap(a, b);
+    out.push_back(horizontal ? Edge{a,line,b,line} : Edge{line,a,line,b});
+  };
+  for (size_t i=0; i<ev.size(); ) {
+    int32_t line = ev[i].line;
+    int cover = 0, run_sign = 0;
+    int32_t run_start = 0;
+    while (i < ev.size() && ev[i].line == line) {
+      int32_t pos = ev[i].pos;
+      for (; i<ev.size() && ev[i].line == line && ev[i].pos == pos; i++) cover += ev[i].delta;
+      int sign = (cover > 0) - (cover < 0);
+      if (sign == run_sign) continue;
+      if (run_sign != 0) emit(line, run_start, pos, run_sign);
+      run_sign = sign;
+      run_start = pos;
+    }
+  }
+}
+
+// Follows the directed edges into closed loops. At a vertex with two ways
+// out (rects touching at a corner) the first unused one by direction rank
+// is taken, as before.
+static std::vector<std::vector<Point>> TraceLoops(std::pmr::vector<Edge>& edges) {
   auto dirRank=[](const Edge& e)->int{
     int32_t dx=e.x2-e.x1, dy=e.y2-e.y1;
     if (dy==0 && dx>0) return 0;
@@ -128,48 +259,63 @@ static std::vector<std::vector<Point>> TraceLoops(std::multiset<Edge>& edges) {
     if (dy==0 && dx<0) return 2;
     return 3;
   };
-  for (auto& kv: adj) {
-    auto& v=kv.second;
-    std::sort(v.begin(), v.end(), [&](const Edge& a,const Edge& b){return dirRank(a)<dirRank(b);});
-  }
+  // sorted by start point, then direction: a vertex's out-edges are a range
+  std::sort(edges.begin(), edges.end(), [&](const Edge& a, const Edge& b){
+    if (a.x1!=b.x1) return a.x1<b.x1;
+    if (a.y1!=b.y1) return a.y1<b.y1;
+    return dirRank(a)<dirRank(b);
+  });
+  auto first_at = [&](int32_t x, int32_t y) {
+    return (size_t)(std::lower_bound(edges.begin(), edges.end(), Point{x,y}, [](const Edge& e, const Point& p){
+      return e.x1!=p.x ? e.x1<p.x : e.y1<p.y;
+    }) - edges.begin());
+  };
 
-  std::set<Edge> used;
+  std::pmr::memory_resource* mr = edges.get_allocator().resource();
+  std::pmr::vector<char> used(edges.size(), 0, mr);
+  std::pmr::vector<Point> poly(mr); // loop under construction, copied out exact-size
   std::vector<std::vector<Point>> polys;
 
-  for (auto& e0: edges) {
-    if (used.count(e0)) continue;
-    std::vector<Point> poly;
-    Edge cur=e0;
-    used.insert(cur);
-    poly.push_back(Point{cur.x1,cur.y1});
+  for (size_t i0=0; i0<edges.size(); i0++) {
+    if (used[i0]) continue;
+    const Edge e0 = edges[i0];
+    poly.clear();
+    size_t cur = i0;
+    used[cur] = 1;
+    poly.push_back(Point{e0.x1,e0.y1});
     while (true) {
-      Point end{cur.x2,cur.y2};
+      Point end{edges[cur].x2,edges[cur].y2};
       if (end.x==e0.x1 && end.y==e0.y1) break;
       poly.push_back(end);
-      auto it=adj.find(pack(end.x,end.y));
-      if (it==adj.end() || it->second.empty()) break;
-      Edge nxt=it->second[0];
-      for (auto& cand: it->second) {
-        if (!(cand.x2==cur.x1 && cand.y2==cur.y1)) { nxt=cand; break; }
+      size_t nxt = edges.size();
+      for (size_t k=first_at(end.x,end.y); k<edges.size() && edges[k].x1==end.x && edges[k].y1==end.y; k++) {
+        if (!used[k]) { nxt = k; break; }
       }
-      if (used.count(nxt)) break;
-      used.insert(nxt);
-      cur=nxt;
+      if (nxt == edges.size()) break;
+      used[nxt] = 1;
+      cur = nxt;
     }
-    if (poly.size()>=4) polys.push_back(std::move(poly));
+    if (poly.size()>=4) polys.emplace_back(poly.begin(), poly.end());
   }
   return polys;
 }
 
-std::vector<std::vector<Point>> RectsToPolygons(const std::vector<Rect>& rects) {
-  std::multiset<Edge> edges;
+std::vector<std::vector<Point>> RectsToPolygons(const RectVec& rects) {
+  std::pmr::memory_resource* mr = rects.get_allocator().resource();
+  std::pmr::vector<LineEvent> h(mr), v(mr);
+  h.reserve(rects.size()*4);
+  v.reserve(rects.size()*4);
   for (auto& r: rects) {
     if (r.x1>=r.x2 || r.y1>=r.y2) continue;
-    AddOrCancel(edges, Edge{r.x1,r.y1,r.x2,r.y1});
-    AddOrCancel(edges, Edge{r.x2,r.y1,r.x2,r.y2});
-    AddOrCancel(edges, Edge{r.x2,r.y2,r.x1,r.y2});
-    AddOrCancel(edges, Edge{r.x1,r.y2,r.x1,r.y1});
+    // counter-clockwise: bottom and right run forward, top and left back
+    h.push_back(LineEvent{r.y1, r.x1, +1}); h.push_back(LineEvent{r.y1, r.x2, -1});
+    h.push_back(LineEvent{r.y2, r.x1, -1}); h.push_back(LineEvent{r.y2, r.x2, +1});
+    v.push_back(LineEvent{r.x2, r.y1, +1}); v.push_back(LineEvent{r.x2, r.y2, -1});
+    v.push_back(LineEvent{r.x1, r.y1, -1}); v.push_back(LineEvent{r.x1, r.y2, +1});
   }
+  std::pmr::vector<Edge> edges(mr);
+  CancelOnLines(h, true, edges);
+  CancelOnLines(v, false, edges);
   return TraceLoops(edges);
 }
 
@@ -1,6 +1,7 @@
 // src/ortho_rect.h
 #pragma once
 #include <vector>
+#include <memory_resource>
 #include <cstdint>
 #include "layout_reader.h"
 
@@ -8,8 +9,20 @@ namespace tracer {
 
 struct Rect { int32_t x1,y1,x2,y2; }; // [x1,x2) [y1,y2)
 
-std::vector<Rect> DecomposeToRects(const Polygon& poly);           // polygon -> rects
-std::vector<Rect> RectDifference(const std::vector<Rect>& A, const std::vector<Rect>& B); // A - B
-std::vector<std::vector<Point>> RectsToPolygons(const std::vector<Rect>& rects); // rects -> boundary polygons
+// Rect lists are pmr vectors: every routine allocates its temporaries from
+// the memory resource of the container it is given, so a caller can run a
+// whole cut on one arena and release it wholesale.
+using RectVec = std::pmr::vector<Rect>;
+
+void DecomposeToRects(const PolyView& poly, RectVec& out);          // polygon -> rects, appended
+
+// Manhattan boolean of two rect sets. Either input may overlap itself; a
+// point counts as covered by a set if any of its rects covers it. The
+// result is disjoint and merged: rects of equal y-span in consecutive
+// x-slabs are joined. O((n + out) log n) scanline.
+enum class RectBoolOp { Union, Intersect, Difference /* A - B */, Xor };
+void RectBoolean(const RectVec& A, const RectVec& B, RectBoolOp op, RectVec& out);
+void RectDifference(const RectVec& A, const RectVec& B, RectVec& out); // A - B
+std::vector<std::vector<Point>> RectsToPolygons(const RectVec& rects); // rects -> boundary polygons
 
 } // namespace tracer
@@ -0,0 +1,126 @@
+// src/parallel.h
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace tracer {
+
+// Runs fn(begin, end, tid) over [0,n) on up to `threads` workers.
+// Workers pull chunks of `grain` items from a shared cursor, so uneven
+// per-item cost still balances. Runs inline when one worker suffices.
+template <class Fn>
+inline void ParallelFor(int threads, size_t n, size_t grain, Fn&& fn) {
+  if (n == 0) return;
+  grain = std::max<size_t>(1, grain);
+  size_t chunks = (n + grain - 1) / grain;
+  int nt = (int)std::min<size_t>((size_t)std::max(1, threads), chunks);
+  if (nt <= 1) { fn((size_t)0, n, 0); return; }
+
+  std::atomic<size_t> next{0};
+  auto work = [&](int tid) {
+    while (true) {
+      size_t b = next.fetch_add(grain, std::memory_order_relaxed);
+      if (b >= n) break;
+      fn(b, std::min(n, b + grain), tid);
+    }
+  };
+  std::vector<std::thread> pool;
+  pool.reserve(nt - 1);
+  for (int t = 1; t < nt; t++) pool.emplace_back(work, t);
+  work(0);
+  for (auto& th : pool) th.join();
+}
+
+// Number of workers ParallelFor will actually use for (threads, n, grain).
+inline int ParallelWorkers(int threads, size_t n, size_t grain) {
+  grain = std::max<size_t>(1, grain);
+  size_t chunks = (n + grain - 1) / grain;
+  return (int)std::max<size_t>(1, std::min<size_t>((size_t)std::max(1, threads), chunks));
+}
+
+// Fixed-size bitmap with lock-free test-and-set, shared by BFS workers.
+// The words are allocated by the first TrySet(), so a trace over many
+// instance parts only pays for the parts it reaches.
+class AtomicBitmap {
+public:
+  AtomicBitmap() = default;
+  AtomicBitmap(AtomicBitmap&& o) noexcept : n_(o.n_), words_(o.words_.exchange(nullptr)) {}
+  AtomicBitmap& operator=(AtomicBitmap&&) = delete;
+  ~AtomicBitmap() { delete[] words_.load(std::memory_order_relaxed); }
+
+  void Reset(size_t n) {
+    n_ = n;
+    delete[] words_.exchange(nullptr, std::memory_order_relaxed);
+  }
+  size_t size() const { return n_; }
+  // false while no bit was ever set
+  bool Touched() const { return words_.load(std::memory_order_acquire) != nullptr; }
+  // true if this call flipped the bit from 0 to 1
+  bool TrySet(size_t i) {
+    uint64_t m = 1ull << (i & 63);
+    return !(Words()[i >> 6].fetch_or(m, std::memory_order_relaxed) & m);
+  }
+  bool Test(size_t i) const {
+    const std::atomic<uint64_t>* w = words_.load(std::memory_order_acquire);
+    return w && ((w[i >> 6].load(std::memory_order_relaxed) >> (i & 63)) & 1);
+  }
+private:
+  std::atomic<uint64_t>* Words() {
+    std::atomic<uint64_t>* w = words_.load(std::memory_order_acquire);
+    if (w) return w;
+    size_t nw = (n_ + 63) / 64;
+    std::atomic<uint64_t>* fresh = new std::atomic<uint64_t>[nw];
+    for (size_t k=0; k<nw; k++) fresh[k].store(0, std::memory_order_relaxed);
+    // racing first setters: one allocation wins, the others are dropped
+    if (words_.compare_exchange_strong(w, fresh, std::memory_order_acq_rel)) return fresh;
+    delete[] fresh;
+    return w;
+  }
+  size_t n_ = 0;
+  std::atomic<std::atomic<uint64_t>*> words_{nullptr};
+};
+
+// Hash map split by key over mutex-guarded shards, for entries that BFS
+// workers create and look up concurrently. The callbacks run under the
+// shard's lock and must not re-enter the map.
+template <class K, class V>
+class ShardedMap {
+public:
+  static const int kShards = 16;
+  // fn(V&) on the entry for k, value-initialized if absent.
+  template <class Fn>
+  auto With(const K& k, Fn&& fn) {
+    Shard& sh = shards_[Slot(k)];
+    std::lock_guard<std::mutex> lk(sh.mu);
+    return fn(sh.map[k]);
+  }
+  // fn(const V*) on the entry for k, null if absent.
+  template <class Fn>
+  auto Find(const K& k, Fn&& fn) const {
+    const Shard& sh = shards_[Slot(k)];
+    std::lock_guard<std::mutex> lk(sh.mu);
+    auto it = sh.map.find(k);
+    return fn(it == sh.map.end() ? nullptr : &it->second);
+  }
+  // fn(const K&, const V&) on every entry, shard by shard.
+  template <class Fn>
+  void ForEach(Fn&& fn) const {
+    for (const Shard& sh: shards_) {
+      std::lock_guard<std::mutex> lk(sh.mu);
+      for (auto& kv: sh.map) fn(kv.first, kv.second);
+    }
+  }
+private:
+  static size_t Slot(const K& k) { return std::hash<K>{}(k) % kShards; }
+  struct Shard { mutable std::mutex mu; std::unordered_map<K, V> map; };
+  Shard shards_[kShards];
+};
+
+} // namespace tracer
@@ -1,12 +1,27 @@
 // src/rule_parser.cpp
 #include "rule_parser.h"
 #include "utils.h"
+#include <charconv>
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
 
 namespace tracer {
 
+int LayerTable::Intern(const std::string& name) {
+  auto it = ids.find(name);
+  if (it!=ids.end()) return it->second;
+  int id = (int)names.size();
+  names.push_back(name);
+  ids.emplace(name, id);
+  return id;
+}
+
+int LayerTable::Find(const std::string& name) const {
+  auto it = ids.find(name);
+  return it==ids.end() ? -1 : it->second;
+}
+
 bool ParseArgs(int argc, char** argv, CmdArgs& out) {
   for (int i=1;i<argc;i++) {
     std::string a = argv[i];
@@ -14,14 +29,47 @@ bool ParseArgs(int argc, char** argv, CmdArgs& out) {
       if (i+1>=argc) { std::cerr<<"Missing value for "<<key<<"\n"; return ""; }
       return argv[++i];
     };
-    if (a=="-layout") out.layout_path = need("-layout");
+    if (a=="--build-cache") {
+      out.layout_path = need("--build-cache");
+      out.cache_path = need("--build-cache");
+    }
+    else if (a=="--build-components") {
+      out.build_components = true;
+      out.layout_path = need("--build-components");
+      out.rule_path = need("--build-components");
+      out.components_path = need("--build-components");
+    }
+    else if (a=="-components") out.components_path = need("-components");
+    else if (a=="-layout") out.layout_path = need("-layout");
+    else if (a=="-serve") out.serve_path = need("-serve");
+    else if (a=="-batch") out.batch_path = need("-batch");
     else if (a=="-rule") out.rule_path = need("-rule");
     else if (a=="-output") out.output_path = need("-output");
     else if (a=="-thread") out.threads = std::max(1, std::atoi(need("-thread").c_str()));
+    else if (a=="-index") {
+      std::string k = need("-index");
+      if (k=="grid") out.index = IndexKind::Grid;
+      else if (k=="rtree") out.index = IndexKind::RTree;
+      else { std::cerr<<"Unknown index backend: "<<k<<"\n"; return false; }
+    }
   }
+  if (!out.cache_path.empty()) return !out.layout_path.empty();
+  if (!out.batch_path.empty() || !out.serve_path.empty()) return !out.layout_path.empty();
+  if (out.build_components) return !out.layout_path.empty() && !out.rule_path.empty() && !out.components_path.empty();
   return !out.layout_path.empty() && !out.rule_path.empty() && !out.output_path.empty();
 }
 
+// Whole of s[b,e) as an int32 coordinate (blanks and a leading '+' allowed).
+static bool ParseCoord(const std::string& s, size_t b, size_t e, int32_t& v) {
+  const char* p = s.data() + b;
+  const char* end = s.data() + e;
+  while (p < end && (*p==' '||*p=='\t')) ++p;
+  while (end > p && (end[-1]==' '||end[-1]=='\t')) --end;
+  if (p < end && *p=='+') ++p;
+  auto r = std::from_chars(p, end, v);
+  return r.ec == std::errc() && r.ptr == end;
+}
+
 static bool ParseStartLine(const std::string& line, std::string& layer, Point& p) {
   auto s = Trim(line);
   auto sp = s.find(' ');
@@ -33,15 +81,16 @@ static bool ParseStartLine(const std::string& line, std::string& layer, Point& p
   auto rp = s.find(')', cm);
   if (lp==std::string::npos||cm==std::string::npos||rp==std::string::npos) return false;
 
-  p.x = (int32_t)std::stoll(s.substr(lp+1, cm-lp-1));
-  p.y = (int32_t)std::stoll(s.substr(cm+1, rp-cm-1));
-  return true;
+  return ParseCoord(s, lp+1, cm, p.x) && ParseCoord(s, cm+1, rp, p.y);
 }
 
 bool LoadRule(const std::string& path, RuleFile& out) {
   std::ifstream fin(path);
   if (!fin) { std::cerr<<"Cannot open rule: "<<path<<"\n"; return false; }
+  return LoadRule(fin, out);
+}
 
+bool LoadRule(std::istream& fin, RuleFile& out) {
   std::vector<std::string> lines;
   std::string line;
   while (std::getline(fin, line)) {
@@ -58,8 +107,12 @@ bool LoadRule(const std::string& path, RuleFile& out) {
     if (L=="Gate") { mode = GATE; continue; }
 
     if (mode==START) {
-      std::string layer; Point p;
-      if (ParseStartLine(L, layer, p)) out.starts.push_back({layer,p});
+      StartPos sp;
+      if (!ParseStartLine(L, sp.layer, sp.pt)) {
+        std::cerr<<"Bad StartPos line: "<<L<<"\n";
+        return false;
+      }
+      out.starts.push_back(sp);
       continue;
     }
     if (mode==VIA) {
@@ -83,13 +136,33 @@ bool LoadRule(const std::string& path, RuleFile& out) {
     return false;
   }
 
-  out.needed_layers.clear();
-  for (auto& s : out.starts) out.needed_layers.insert(s.first);
-  for (auto& vr : out.via_rules) for (auto& ly : vr.layers) out.needed_layers.insert(ly);
+  for (auto& s : out.starts) s.layer_id = out.layers.Intern(s.layer);
+  for (auto& vr : out.via_rules) {
+    vr.layer_ids.clear();
+    for (auto& ly : vr.layers) vr.layer_ids.push_back(out.layers.Intern(ly));
+  }
   if (out.gate.has_gate) {
-    out.needed_layers.insert(out.gate.poly_layer);
-    out.needed_layers.insert(out.gate.aa_layer);
+    out.gate.poly_id = out.layers.Intern(out.gate.poly_layer);
+    out.gate.aa_id   = out.layers.Intern(out.gate.aa_layer);
+  }
+
+  out.needed_layers.clear();
+  for (auto& ly : out.layers.names) out.needed_layers.insert(ly);
+  return true;
+}
+
+bool LoadBatchList(const std::string& path, std::vector<BatchJob>& out) {
+  std::ifstream fin(path);
+  if (!fin) { std::cerr<<"Cannot open batch list: "<<path<<"\n"; return false; }
+  std::string line;
+  for (int ln=1; std::getline(fin, line); ln++) {
+    line = Trim(line);
+    if (line.empty() || line[0]=='#') continue;
+    auto toks = SplitWS(line);
+    if (toks.size()!=2) { std::cerr<<"Bad batch line "<<ln<<": "<<line<<"\n"; return false; }
+    out.push_back(BatchJob{toks[0], toks[1]});
   }
+  if (out.empty()) { std::cerr<<"Empty batch list: "<<path<<"\n"; return false; }
   return true;
 }
 
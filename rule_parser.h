@@ -1,35 +1,67 @@
 // src/rule_parser.h
 #pragma once
+#include <iosfwd>
 #include <string>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
 #include <cstdint>
 
 namespace tracer {
 
 struct Point { int32_t x=0, y=0; };
 
-struct ViaRule { std::vector<std::string> layers; };
+// Layer names interned to dense IDs (first-seen order) so the tracer can
+// index per-layer data with vectors instead of string-keyed maps.
+struct LayerTable {
+  std::vector<std::string> names;            // id -> name
+  std::unordered_map<std::string, int> ids;  // name -> id
+  int Intern(const std::string& name);
+  int Find(const std::string& name) const;   // -1 if unknown
+  int size() const { return (int)names.size(); }
+};
+
+struct StartPos { std::string layer; int layer_id = -1; Point pt; };
+
+struct ViaRule { std::vector<std::string> layers; std::vector<int> layer_ids; };
 
 struct GateRule {
   bool has_gate = false;
   std::string poly_layer;
   std::string aa_layer;
+  int poly_id = -1, aa_id = -1;
 };
 
 struct RuleFile {
-  std::vector<std::pair<std::string, Point>> starts; // 1 or 2
+  std::vector<StartPos> starts; // 1 or 2
   std::vector<ViaRule> via_rules;
   GateRule gate;
+  LayerTable layers; // every layer the rule mentions
   std::unordered_set<std::string> needed_layers;
 };
 
+// Spatial index backend used for every layer (see spatial_index.h).
+enum class IndexKind { Grid, RTree };
+
 struct CmdArgs {
   std::string layout_path, rule_path, output_path;
+  std::string cache_path; // --build-cache: write layout_path as a binary cache here
+  std::string components_path; // -components: precomputed labels to trace with
+  bool build_components = false; // --build-components: write labels to components_path
+  std::string batch_path; // -batch: list of "rule output" pairs traced in one run
+  std::string serve_path; // -serve: Unix socket to listen on, or "-" for stdin/stdout
   int threads = 1;
+  IndexKind index = IndexKind::Grid;
 };
 
+// One net of a -batch list.
+struct BatchJob { std::string rule_path, output_path; };
+
 bool ParseArgs(int argc, char** argv, CmdArgs& out);
+// Layer ids interned into `out.layers`; prefill it to share ids across rules.
 bool LoadRule(const std::string& path, RuleFile& out);
+bool LoadRule(std::istream& in, RuleFile& out);
+// Reads "rule_path output_path" lines; blank lines and '#' comments skipped.
+bool LoadBatchList(const std::string& path, std::vector<BatchJob>& out);
 
 } // namespace tracer
@@ -0,0 +1,270 @@
+// src/server.cpp
+#include "server.h"
+#include "engine.h"
+#include "layout_reader.h"
+#include "utils.h"
+#include "writer.h"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace tracer {
+
+// Reads one request body up to its "END" line; false at end of input.
+static bool ReadRequest(std::istream& in, std::string& body) {
+  body.clear();
+  std::string line;
+  while (std::getline(in, line)) {
+    if (Trim(line) == "END") return true;
+    body += line;
+    body += '\n';
+  }
+  return false;
+}
+
+// Traces one request against the shared context. Rule layer ids are
+// interned on top of the layout's table, so they index ctx directly; names
+// the layout lacks get ids past it and trace as empty layers, as they do
+// from the CLI.
+static std::string ServeRequest(const std::string& body, const TraceContext& ctx, const LayerTable& table,
+                                int threads) {
+  auto t0 = std::chrono::steady_clock::now();
+  RuleFile rule;
+  rule.layers = table;
+  std::istringstream in(body);
+  if (!LoadRule(in, rule)) return "ERR bad rule\n";
+
+  TraceResult res;
+  std::ostringstream out;
+  if (!TraceNet(rule, ctx, threads, res) || !WriteResult(out, res)) return "ERR trace failed\n";
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+  std::cerr << "[SERVE] polys_out=" << res.total_polygons << " ms=" << ms << "\n";
+  std::string payload = out.str();
+  return "OK " + std::to_string(payload.size()) + "\n" + payload;
+}
+
+// ServeRequest, with anything it throws answered as an error: one bad
+// request must not take the server down.
+static std::string Serve(const std::string& body, const TraceContext& ctx, const LayerTable& table,
+                         int threads) {
+  try {
+    return ServeRequest(body, ctx, table, threads);
+  } catch (const std::exception& e) {
+    std::cerr << "[SERVE] request failed: " << e.what() << "\n";
+    return std::string("ERR ") + e.what() + "\n";
+  }
+}
+
+static void ServeStream(std::istream& in, std::ostream& out, const TraceContext& ctx,
+                        const LayerTable& table, int threads) {
+  std::string body;
+  while (ReadRequest(in, body)) {
+    out << Serve(body, ctx, table, threads);
+    out.flush();
+  }
+}
+
+#ifndef _WIN32
+
+// Moves the first complete request of `buf` (up to its "END" line) to
+// `body`, like ReadRequest over a stream; false if none is complete yet.
+static bool NextRequest(std::string& buf, std::string& body) {
+  body.clear();
+  size_t p = 0;
+  while (p < buf.size()) {
+    size_t eol = buf.find('\n', p);
+    if (eol == std::string::npos) return false;
+    const char* b = buf.data() + p;
+    const char* e = buf.data() + eol;
+    TrimRange(b, e);
+    if (std::string(b, e) == "END") { buf.erase(0, eol + 1); return true; }
+    body.append(buf, p, eol - p + 1);
+    p = eol + 1;
+  }
+  return false;
+}
+
+static bool SendAll(int fd, const std::string& s) {
+  size_t done = 0;
+  while (done < s.size()) {
+    ssize_t w = ::send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    done += (size_t)w;
+  }
+  return true;
+}
+
+// A client connection. Only the dispatcher touches it while it is polled,
+// only the worker it was handed to while it is queued or served.
+struct Conn {
+  explicit Conn(int fd) : fd(fd) {}
+  ~Conn() { ::close(fd); }
+  int fd;
+  std::string in;                // received, not yet a complete request
+  std::deque<std::string> reqs;  // complete requests, in arrival order
+  bool eof = false;
+};
+
+// Connections with requests ready for a worker.
+class ConnQueue {
+public:
+  void Push(Conn* c) {
+    { std::lock_guard<std::mutex> lk(mu_); q_.push_back(c); }
+    cv_.notify_one();
+  }
+  Conn* Pop() {
+    std::unique_lock<std::mutex> lk(mu_);
+    cv_.wait(lk, [&]{ return !q_.empty(); });
+    Conn* c = q_.front();
+    q_.pop_front();
+    return c;
+  }
+private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<Conn*> q_;
+};
+
+// A reply that cannot be sent for this long drops the connection, so a
+// client that stops reading frees its worker.
+static const int kSendTimeoutSec = 10;
+
+// The dispatcher (this thread) polls every connection and reads what
+// arrives; a connection goes to the worker queue only once it holds a
+// complete request, and comes back after its requests are answered. So
+// workers are busy only while tracing, and idle or slow clients hold none.
+static int ServeSocket(const std::string& path, const TraceContext& ctx, const LayerTable& table,
+                       int threads) {
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path)) { std::cerr<<"Socket path too long: "<<path<<"\n"; return 1; }
+  int lfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0) { std::cerr<<"Cannot create socket\n"; return 1; }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  ::unlink(path.c_str()); // stale socket from a previous server
+  int wake[2];
+  if (::bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(lfd, 64) != 0 || ::pipe(wake) != 0) {
+    std::cerr<<"Cannot listen on "<<path<<"\n";
+    ::close(lfd);
+    return 1;
+  }
+  std::cerr << "[SERVE] listening on " << path << " workers=" << threads << "\n";
+
+  // connections whose requests are answered, back for the dispatcher to poll
+  std::mutex done_mu;
+  std::vector<Conn*> done;
+
+  // each request is traced single-threaded; concurrency comes from the pool
+  ConnQueue queue;
+  std::vector<std::thread> pool;
+  for (int t=0; t<threads; t++) {
+    pool.emplace_back([&]{
+      while (true) {
+        Conn* c = queue.Pop();
+        bool ok = true;
+        while (ok && !c->reqs.empty()) {
+          ok = SendAll(c->fd, Serve(c->reqs.front(), ctx, table, 1));
+          c->reqs.pop_front();
+        }
+        if (!ok || c->eof) { delete c; continue; }
+        { std::lock_guard<std::mutex> lk(done_mu); done.push_back(c); }
+        char b = 0;
+        while (::write(wake[1], &b, 1) < 0 && errno == EINTR) {}
+      }
+    });
+  }
+
+  std::vector<Conn*> idle;
+  std::vector<pollfd> fds;
+  std::vector<char> buf(1 << 16);
+  std::string body;
+  while (true) {
+    fds.assign({pollfd{lfd, POLLIN, 0}, pollfd{wake[0], POLLIN, 0}});
+    for (Conn* c: idle) fds.push_back(pollfd{c->fd, POLLIN, 0});
+    if (::poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      std::cerr<<"poll failed on "<<path<<"\n";
+      break;
+    }
+    size_t keep = 0;
+    for (size_t k=0; k<idle.size(); k++) {
+      Conn* c = idle[k];
+      if (fds[k+2].revents) {
+        ssize_t n = ::recv(c->fd, buf.data(), buf.size(), MSG_DONTWAIT);
+        if (n > 0) c->in.append(buf.data(), (size_t)n);
+        else if (n == 0) { c->eof = true; c->in += '\n'; } // a last "END" may lack its newline
+        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { delete c; continue; }
+        while (NextRequest(c->in, body)) c->reqs.push_back(body);
+        if (!c->reqs.empty()) { queue.Push(c); continue; }
+        if (c->eof) { delete c; continue; }
+      }
+      idle[keep++] = c;
+    }
+    idle.resize(keep);
+    if (fds[1].revents) {
+      char drain[256];
+      while (::read(wake[0], drain, sizeof(drain)) < 0 && errno == EINTR) {}
+      std::lock_guard<std::mutex> lk(done_mu);
+      idle.insert(idle.end(), done.begin(), done.end());
+      done.clear();
+    }
+    if (fds[0].revents) {
+      int fd = ::accept(lfd, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        std::cerr<<"accept failed on "<<path<<"\n";
+        break;
+      }
+      timeval tv{kSendTimeoutSec, 0};
+      ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      idle.push_back(new Conn(fd));
+    }
+  }
+  ::close(lfd);
+  for (auto& th: pool) th.detach();
+  return 1;
+}
+
+#endif
+
+int RunServer(const CmdArgs& args) {
+  LayoutDB db;
+  if (!LoadLayoutAllLayers(args.layout_path, args.threads, db)) return 3;
+  LayerTable table;
+  for (auto& n: db.names) table.Intern(n);
+
+  TraceOptions opt;
+  opt.threads = args.threads;
+  opt.index = args.index;
+  opt.cache_aa_cuts = true;
+  TraceContext ctx;
+  BuildTraceContext(db, opt, ctx);
+
+  if (args.serve_path == "-") {
+    ServeStream(std::cin, std::cout, ctx, table, args.threads);
+    return 0;
+  }
+#ifdef _WIN32
+  std::cerr << "Socket serving is not supported on Windows; use -serve -\n";
+  return 1;
+#else
+  return ServeSocket(args.serve_path, ctx, table, args.threads);
+#endif
+}
+
+} // namespace tracer
@@ -0,0 +1,22 @@
+// src/server.h
+#pragma once
+#include "rule_parser.h"
+
+namespace tracer {
+
+// Resident trace server (trace -layout L -serve PATH). Loads every layer of
+// the layout and builds its indices once, then answers trace requests until
+// killed (socket) or end of input ("-": stdin/stdout).
+//
+// Request:  rule file text, terminated by a line "END".
+// Response: "OK <n>\n" followed by n bytes in the result file format, or
+//           "ERR <message>\n".
+//
+// A socket accepts any number of connections, each of which may send any
+// number of requests in turn. Requests are read by one dispatcher thread
+// and traced by `threads` workers once complete, so idle or slow clients
+// hold no worker; a client that stops reading its replies for 10 s is
+// disconnected.
+int RunServer(const CmdArgs& args);
+
+} // namespace tracer
@@ -1,16 +1,21 @@
 #include "spatial_index.h"
+#include "parallel.h"
+#include "hierarchy.h"
+#include "candidate_filter.h"
 #include <algorithm>
+#include <chrono>
+#include <iostream>
 
 namespace tracer {
 
-int32_t AutoCellSize(const std::vector<Polygon>& polys) {
+int32_t AutoCellSize(const LayerData& polys) {
   if (polys.empty()) return 1024;
   size_t n = polys.size();
   size_t step = std::max<size_t>(1, n / 2000);
   std::vector<int32_t> ws, hs;
   for (size_t i=0, cnt=0; i<n && cnt<2000; i+=step, ++cnt) {
-    ws.push_back(std::max<int32_t>(1, polys[i].maxx - polys[i].minx));
-    hs.push_back(std::max<int32_t>(1, polys[i].maxy - polys[i].miny));
+    ws.push_back(std::max<int32_t>(1, polys.maxx[i] - polys.minx[i]));
+    hs.push_back(std::max<int32_t>(1, polys.maxy[i] - polys.miny[i]));
   }
   std::nth_element(ws.begin(), ws.begin()+ws.size()/2, ws.end());
   std::nth_element(hs.begin(), hs.begin()+hs.size()/2, hs.end());
@@ -18,36 +23,376 @@ int32_t AutoCellSize(const std::vector<Polygon>& polys) {
   return std::max<int32_t>(64, med*4);
 }
 
-static inline void CellsForBBox(const Polygon& p, int32_t cell,
-                                int32_t& gx0,int32_t& gy0,int32_t& gx1,int32_t& gy1){
-  gx0 = p.minx / cell; gy0 = p.miny / cell;
-  gx1 = p.maxx / cell; gy1 = p.maxy / cell;
+// ---- multi-level grid ----
+// Level 0 tables beyond this many cells per polygon (and kMinGridCells) get
+// a coarser base cell instead.
+static const size_t kCellsPerPoly = 4;
+static const size_t kMinGridCells = 1 << 16;
+static const int kMaxLevels = 40;
+
+// Cells [c0,c1] of a row of n cells from `origin` that [lo,hi] touches
+// (floor division, clamped to the row); false if none.
+static inline bool CellSpan(int64_t lo, int64_t hi, int32_t origin, int64_t cell, int32_t n,
+                            int32_t& c0, int32_t& c1) {
+  lo -= origin; hi -= origin;
+  if (hi < 0 || lo >= n * cell) return false;
+  c0 = (int32_t)(std::max<int64_t>(lo, 0) / cell);
+  c1 = (int32_t)std::min<int64_t>(hi / cell, n - 1);
+  return true;
 }
 
-void SpatialIndex::Build(const std::vector<Polygon>& polys, int32_t cell_size) {
-  cell_ = cell_size>0?cell_size:1024;
-  grid_.clear();
-  grid_.reserve(polys.size());
+// Most cells a polygon may cover before it moves up a level. High enough
+// that long thin wires stay on the fine level, low enough to bound entries.
+static const int64_t kMaxPolyCells = 16;
 
-  for (int i=0;i<(int)polys.size();i++){
-    int32_t gx0,gy0,gx1,gy1;
-    CellsForBBox(polys[i], cell_, gx0,gy0,gx1,gy1);
-    for (int32_t gx=gx0; gx<=gx1; gx++){
-      for (int32_t gy=gy0; gy<=gy1; gy++){
-        grid_[CellKey{gx,gy}].push_back(i);
+// First level (cell side cell0 << k) on which the box, given relative to
+// the grid origin, covers at most kMaxPolyCells cells.
+static inline int LevelOf(int64_t x0, int64_t y0, int64_t x1, int64_t y1, int64_t cell0) {
+  int k = 0;
+  for (int64_t c = cell0; (x1/c - x0/c + 1) * (y1/c - y0/c + 1) > kMaxPolyCells; c <<= 1) k++;
+  return k;
+}
+
+bool GridIndex::Build(const LayerData& polys, int32_t cell_size, int threads) {
+  levels_.clear(); offs_.clear(); ids_.clear();
+  size_t n = polys.size();
+  if (n == 0) return true;
+  if (n > kIdMask) return false;
+
+  int32_t ex0=polys.minx[0], ey0=polys.miny[0], ex1=polys.maxx[0], ey1=polys.maxy[0];
+  for (size_t i=1;i<n;i++){
+    ex0=std::min(ex0,polys.minx[i]); ey0=std::min(ey0,polys.miny[i]);
+    ex1=std::max(ex1,polys.maxx[i]); ey1=std::max(ey1,polys.maxy[i]);
+  }
+  int64_t w = (int64_t)ex1 - ex0, h = (int64_t)ey1 - ey0;
+  int64_t cell0 = cell_size>0?cell_size:1024;
+  size_t max_cells = std::max(kMinGridCells, n * kCellsPerPoly);
+  while ((uint64_t)(w/cell0+1) * (uint64_t)(h/cell0+1) > max_cells) cell0 *= 2;
+  ox_ = ex0; oy_ = ey0;
+
+  std::vector<uint8_t> lvl(n);
+  ParallelFor(threads, n, 1 << 14, [&](size_t b, size_t e, int){
+    for (size_t i=b;i<e;i++){
+      lvl[i] = (uint8_t)LevelOf((int64_t)polys.minx[i] - ox_, (int64_t)polys.miny[i] - oy_,
+                                (int64_t)polys.maxx[i] - ox_, (int64_t)polys.maxy[i] - oy_, cell0);
+    }
+  });
+  size_t count[kMaxLevels] = {0};
+  for (size_t i=0;i<n;i++) count[lvl[i]]++;
+  int slot[kMaxLevels];
+  size_t ncell = 0;
+  for (int k=0;k<kMaxLevels;k++){
+    slot[k] = -1;
+    if (!count[k]) continue;
+    Level L;
+    L.cell = cell0 << k;
+    L.gw = (int32_t)(w/L.cell+1); L.gh = (int32_t)(h/L.cell+1);
+    L.base = (uint32_t)ncell;
+    ncell += (size_t)L.gw * L.gh;
+    slot[k] = (int)levels_.size();
+    levels_.push_back(L);
+  }
+
+  if (ncell >= UINT32_MAX) { levels_.clear(); return false; }
+
+  // visit(c, entry) for every cell of polygon i, in cell order
+  auto for_cells = [&](size_t i, auto&& visit) {
+    const Level& L = levels_[slot[lvl[i]]];
+    int32_t gx0=0,gy0=0,gx1=0,gy1=0;
+    CellSpan(polys.minx[i], polys.maxx[i], ox_, L.cell, L.gw, gx0, gx1);
+    CellSpan(polys.miny[i], polys.maxy[i], oy_, L.cell, L.gh, gy0, gy1);
+    for (int32_t gy=gy0; gy<=gy1; gy++){
+      for (int32_t gx=gx0; gx<=gx1; gx++){
+        visit((uint32_t)(L.base + (size_t)gy * L.gw + gx),
+              (uint32_t)i | (gx==gx0 ? kFirstCol : 0) | (gy==gy0 ? kFirstRow : 0));
       }
     }
+  };
+
+  // counts in offs_[c+1] -> offsets; false if the entries overflow them
+  auto prefix = [&]{
+    uint64_t total = 0;
+    for (size_t c=0;c<ncell;c++) { total += offs_[c+1]; offs_[c+1] = (uint32_t)total; }
+    if (total > UINT32_MAX) return false;
+    ids_.resize(total);
+    return true;
+  };
+  auto fail = [&]{ levels_.clear(); offs_.clear(); return false; };
+
+  offs_.assign(ncell + 1, 0);
+  if (threads <= 1) {
+    for (size_t i=0;i<n;i++) for_cells(i, [&](uint32_t c, uint32_t){ offs_[c+1]++; });
+    if (!prefix()) return fail();
+    // offs_[c] serves as cell c's fill cursor, ending at the start of c+1
+    for (size_t i=0;i<n;i++) for_cells(i, [&](uint32_t c, uint32_t entry){ ids_[offs_[c]++] = entry; });
+  } else {
+    // One pass over contiguous chunks of polygons buckets every entry by
+    // band of cells. Each band is then counted and filled by one worker,
+    // reading the chunks in order, so entries land in polygon order and
+    // each is handled a fixed number of times whatever the thread count.
+    using Entry = std::pair<uint32_t, uint32_t>; // cell, entry
+    size_t chunks = (size_t)threads;
+    size_t nb = std::min(ncell, chunks * 2);
+    size_t band_cells = (ncell + nb - 1) / nb;
+    std::vector<std::vector<std::vector<Entry>>> bucket(chunks, std::vector<std::vector<Entry>>(nb));
+    ParallelFor(threads, chunks, 1, [&](size_t b, size_t e, int){
+      for (size_t t=b; t<e; t++) {
+        auto& bt = bucket[t];
+        for (size_t i=n*t/chunks; i<n*(t+1)/chunks; i++) {
+          for_cells(i, [&](uint32_t c, uint32_t entry){ bt[c / band_cells].push_back({c, entry}); });
+        }
+      }
+    });
+    ParallelFor(threads, nb, 1, [&](size_t b, size_t e, int){
+      for (; b<e; b++) for (auto& bt: bucket) for (auto& en: bt[b]) offs_[en.first+1]++;
+    });
+    if (!prefix()) return fail();
+    ParallelFor(threads, nb, 1, [&](size_t b, size_t e, int){
+      for (; b<e; b++) for (auto& bt: bucket) for (auto& en: bt[b]) ids_[offs_[en.first]++] = en.second;
+    });
   }
+  for (size_t c=ncell;c>0;c--) offs_[c] = offs_[c-1];
+  offs_[0] = 0;
+  return true;
 }
 
-void SpatialIndex::QueryCandidates(const Polygon& q, std::vector<int>& out) const {
-  int32_t gx0,gy0,gx1,gy1;
-  CellsForBBox(q, cell_, gx0,gy0,gx1,gy1);
-  for (int32_t gx=gx0; gx<=gx1; gx++){
+void GridIndex::Query(const BBox& q, std::vector<int>& out) const {
+  for (const Level& L: levels_) {
+    int32_t gx0,gy0,gx1,gy1;
+    if (!CellSpan(q.minx, q.maxx, ox_, L.cell, L.gw, gx0, gx1)) continue;
+    if (!CellSpan(q.miny, q.maxy, oy_, L.cell, L.gh, gy0, gy1)) continue;
     for (int32_t gy=gy0; gy<=gy1; gy++){
-      auto it = grid_.find(CellKey{gx,gy});
-      if (it==grid_.end()) continue;
-      out.insert(out.end(), it->second.begin(), it->second.end());
+      for (int32_t gx=gx0; gx<=gx1; gx++){
+        // report from the first cell of the overlap of q and the polygon's span
+        uint32_t need = (gx==gx0 ? 0 : kFirstCol) | (gy==gy0 ? 0 : kFirstRow);
+        size_t c = L.base + (size_t)gy * L.gw + gx;
+        for (uint32_t k=offs_[c]; k<offs_[c+1]; k++){
+          uint32_t e = ids_[k];
+          if ((e & need) == need) out.push_back((int)(e & kIdMask));
+        }
+      }
+    }
+  }
+}
+
+size_t GridIndex::MemoryBytes() const {
+  return (offs_.capacity() + ids_.capacity()) * sizeof(uint32_t) + levels_.capacity() * sizeof(Level);
+}
+
+// ---- packed Hilbert R-tree ----
+// Hilbert index of (x,y) on a 2^16 x 2^16 grid.
+static uint32_t HilbertD(uint32_t x, uint32_t y) {
+  uint32_t d = 0;
+  for (uint32_t s = 1u<<15; s > 0; s >>= 1) {
+    uint32_t rx = (x & s) ? 1 : 0;
+    uint32_t ry = (y & s) ? 1 : 0;
+    d += s * s * ((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) { x = s-1 - (x & (s-1)); y = s-1 - (y & (s-1)); }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+void PackedRTree::Build(const LayerData& polys, int threads) {
+  minx_.clear(); miny_.clear(); maxx_.clear(); maxy_.clear();
+  ids_.clear(); level_end_.clear();
+  size_t n = polys.size();
+  if (n == 0) return;
+
+  int64_t ex0=polys.minx[0], ey0=polys.miny[0], ex1=polys.maxx[0], ey1=polys.maxy[0];
+  for (size_t i=1;i<n;i++){
+    ex0=std::min<int64_t>(ex0,polys.minx[i]); ey0=std::min<int64_t>(ey0,polys.miny[i]);
+    ex1=std::max<int64_t>(ex1,polys.maxx[i]); ey1=std::max<int64_t>(ey1,polys.maxy[i]);
+  }
+  int64_t w = std::max<int64_t>(1, ex1-ex0), h = std::max<int64_t>(1, ey1-ey0);
+
+  std::vector<std::pair<uint32_t,int>> order(n);
+  ParallelFor(threads, n, 1 << 14, [&](size_t b, size_t e, int){
+    for (size_t i=b;i<e;i++){
+      int64_t cx = ((int64_t)polys.minx[i] + polys.maxx[i])/2 - ex0;
+      int64_t cy = ((int64_t)polys.miny[i] + polys.maxy[i])/2 - ey0;
+      order[i] = { HilbertD((uint32_t)(cx*65535/w), (uint32_t)(cy*65535/h)), (int)i };
+    }
+  });
+  std::sort(order.begin(), order.end());
+
+  // total boxes: n leaves plus ceil(n/B) + ceil(n/B^2) + ... nodes
+  size_t total = n;
+  for (size_t m=n; m>1; ) { m = (m + kNodeSize - 1) / kNodeSize; total += m; }
+  minx_.reserve(total); miny_.reserve(total); maxx_.reserve(total); maxy_.reserve(total);
+  ids_.reserve(n);
+
+  for (auto& o: order) {
+    size_t i = o.second;
+    minx_.push_back(polys.minx[i]); miny_.push_back(polys.miny[i]);
+    maxx_.push_back(polys.maxx[i]); maxy_.push_back(polys.maxy[i]);
+    ids_.push_back(o.second);
+  }
+  level_end_.push_back(n);
+
+  size_t lb = 0, le = n;
+  while (le - lb > 1) {
+    for (size_t i=lb; i<le; i+=kNodeSize) {
+      size_t e = std::min(le, i + kNodeSize);
+      int32_t x0=minx_[i], y0=miny_[i], x1=maxx_[i], y1=maxy_[i];
+      for (size_t k=i+1; k<e; k++) {
+        x0=std::min(x0,minx_[k]); y0=std::min(y0,miny_[k]);
+        x1=std::max(x1,maxx_[k]); y1=std::max(y1,maxy_[k]);
+      }
+      minx_.push_back(x0); miny_.push_back(y0); maxx_.push_back(x1); maxy_.push_back(y1);
+    }
+    lb = le; le = minx_.size();
+    level_end_.push_back(le);
+  }
+}
+
+void PackedRTree::Query(const BBox& q, std::vector<int>& out) const {
+  if (ids_.empty()) return;
+  size_t root = minx_.size() - 1;
+  if (!Touch(root, q)) return;
+  if (level_end_.size() == 1) { out.push_back(ids_[0]); return; }
+
+  // stack of (box position, level)
+  std::pair<size_t,int> stack[64 * kNodeSize];
+  int sp = 0;
+  stack[sp++] = { root, (int)level_end_.size()-1 };
+  while (sp > 0) {
+    auto [pos, lvl] = stack[--sp];
+    size_t lstart = lvl==0 ? 0 : level_end_[lvl-1];
+    size_t cstart = (lvl-1==0 ? 0 : level_end_[lvl-2]);
+    size_t c0 = cstart + (pos - lstart) * kNodeSize;
+    size_t c1 = std::min(level_end_[lvl-1], c0 + kNodeSize);
+    for (size_t c=c0; c<c1; c++) {
+      if (!Touch(c, q)) continue;
+      if (lvl-1 == 0) out.push_back(ids_[c]);
+      else stack[sp++] = { c, lvl-1 };
+    }
+  }
+}
+
+size_t PackedRTree::MemoryBytes() const {
+  return (minx_.capacity() + miny_.capacity() + maxx_.capacity() + maxy_.capacity()) * sizeof(int32_t)
+       + ids_.capacity() * sizeof(int) + level_end_.capacity() * sizeof(size_t);
+}
+
+// ---- backend dispatch ----
+void SpatialIndex::Build(const LayerData& polys, IndexKind kind, int threads) {
+  kind_ = kind;
+  if (kind_ == IndexKind::Grid && !grid_.Build(polys, AutoCellSize(polys), threads)) {
+    std::cerr<<"Too many polygons for the grid index, using the R-tree\n";
+    kind_ = IndexKind::RTree;
+  }
+  if (kind_ == IndexKind::RTree) rtree_.Build(polys, threads);
+}
+
+void SpatialIndex::QueryCandidates(const PolyView& q, std::vector<int>& out) const {
+  QueryBox(BBoxOf(q), out);
+}
+
+void SpatialIndex::QueryBox(const BBox& q, std::vector<int>& out) const {
+  if (kind_ == IndexKind::RTree) rtree_.Query(q, out);
+  else grid_.Query(q, out);
+}
+
+void SpatialIndex::QueryPoint(const Point& p, std::vector<int>& out) const {
+  size_t b = out.size();
+  if (kind_ == IndexKind::RTree) rtree_.Query(BBox{p.x, p.y, p.x, p.y}, out);
+  else grid_.Query(BBox{p.x, p.y, p.x, p.y}, out);
+  std::sort(out.begin() + b, out.end());
+}
+
+size_t SpatialIndex::MemoryBytes() const {
+  return kind_ == IndexKind::RTree ? rtree_.MemoryBytes() : grid_.MemoryBytes();
+}
+
+// Layers at least this big get all threads to themselves.
+static const size_t kSplitLayerPolys = 1 << 15;
+
+void BuildIndices(const LayoutDB& db, IndexKind kind, const std::vector<char>& need,
+                  int threads, std::vector<SpatialIndex>& idx) {
+  idx.clear();
+  idx.resize(db.NumLayers());
+  std::vector<size_t> small;
+  for (size_t id=0; id<db.NumLayers(); id++) {
+    if (!need[id]) continue;
+    if (threads > 1 && db.LayerSize(id) >= kSplitLayerPolys) idx[id].Build(db.Layer(id), kind, threads);
+    else small.push_back(id);
+  }
+  ParallelFor(threads, small.size(), 1, [&](size_t b, size_t e, int){
+    for (size_t k=b; k<e; k++) idx[small[k]].Build(db.Layer(small[k]), kind);
+  });
+}
+
+void LayerIndices::Init(const LayoutDB& db, IndexKind kind, int threads) {
+  db_ = &db;
+  kind_ = kind;
+  threads_ = threads;
+  layers_.Init(db.NumLayers());
+  masters_.Init(db.hier ? db.hier->NumMasters() : 0);
+  places_.Init(db.hier ? db.hier->NumInstSlots() : 0);
+}
+
+const SpatialIndex& LayerIndices::Build(Slot& s, size_t k, const LayerData& L) const {
+  std::call_once(s.once[k], [&]{
+    auto t0 = std::chrono::steady_clock::now();
+    s.idx[k].Build(L, kind_, L.size() >= kSplitLayerPolys ? threads_ : 1);
+    s.build_ms[k] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+  });
+  return s.idx[k];
+}
+
+const SpatialIndex& LayerIndices::Get(int part) const {
+  if (part < (int)db_->NumLayers()) return Build(layers_, part, db_->Layer(part));
+  size_t key = db_->hier->PartMaster(part);
+  return Build(masters_, key, db_->hier->Master(key));
+}
+
+void LayerIndices::Parts(int layer, const BBox& q, std::vector<int>& parts) const {
+  if (layer < 0 || layer >= (int)db_->NumLayers()) return;
+  if (db_->LayerSize(layer) > 0) parts.push_back(layer);
+  if (!db_->hier) return;
+  const Hierarchy& h = *db_->hier;
+  // Depth first from the top level (cell -1), entering the instances whose
+  // bbox on `layer` touches q, with q mapped into each cell's coordinates.
+  // Instances are pushed in reverse, so parts come out increasing.
+  struct Frame { int cell; BBox q; int64_t first; };
+  thread_local std::vector<Frame> stack;
+  thread_local std::vector<int> cand;
+  stack.assign(1, Frame{-1, q, (int64_t)db_->NumLayers()});
+  while (!stack.empty()) {
+    Frame f = stack.back();
+    stack.pop_back();
+    if (f.cell >= 0) {
+      int own = h.OwnPart(f.cell, layer);
+      if (own >= 0 && BoxesTouch(h.MasterBox(h.MasterKey(f.cell, layer)), f.q)) parts.push_back((int)(f.first + own));
+    }
+    const LayerData& boxes = h.InstBoxes(f.cell, layer);
+    if (boxes.empty()) continue;
+    cand.clear();
+    Build(places_, h.InstSlot(f.cell, layer), boxes).QueryBox(f.q, cand);
+    size_t n = FilterCandidates(boxes, f.q, nullptr, cand.data(), cand.size());
+    std::sort(cand.begin(), cand.begin() + n);
+    const auto& ids = h.InstBoxIds(f.cell, layer);
+    const auto& insts = h.Insts(f.cell);
+    for (size_t k=n; k-- > 0; ) {
+      const Hierarchy::Inst& in = insts[ids[cand[k]]];
+      stack.push_back(Frame{in.cell, ApplyBox(in.t.Inverse(), f.q), f.first + h.InstFirst(f.cell, ids[cand[k]])});
+    }
+  }
+}
+
+void LayerIndices::Stats(size_t& built, size_t& masters, size_t& bytes, double& build_ms) const {
+  built = masters = bytes = 0;
+  build_ms = 0;
+  for (const Slot* s: {&layers_, &masters_, &places_}) {
+    for (size_t k=0; k<s->idx.size(); k++) {
+      if (s->build_ms[k] < 0) continue;
+      if (s == &layers_) built++;
+      if (s == &masters_) masters++;
+      bytes += s->idx[k].MemoryBytes();
+      build_ms += s->build_ms[k];
     }
   }
 }
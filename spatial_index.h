@@ -1,31 +1,137 @@
 #pragma once
-#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <cstdint>
 #include "layout_reader.h"
 
 namespace tracer {
 
-struct CellKey {
-  int32_t gx, gy;
-  bool operator==(const CellKey& o) const { return gx==o.gx && gy==o.gy; }
+struct BBox { int32_t minx=0, miny=0, maxx=0, maxy=0; };
+
+static inline BBox BBoxOf(const PolyView& p) { return BBox{p.minx, p.miny, p.maxx, p.maxy}; }
+static inline BBox BBoxOf(const LayerData& L, size_t i) { return BBox{L.minx[i], L.miny[i], L.maxx[i], L.maxy[i]}; }
+static inline BBox ApplyBox(const Transform& t, const BBox& b) {
+  Point p = t.Apply(Point{b.minx, b.miny}), q = t.Apply(Point{b.maxx, b.maxy});
+  return BBox{std::min(p.x, q.x), std::min(p.y, q.y), std::max(p.x, q.x), std::max(p.y, q.y)};
+}
+static inline bool BoxesTouch(const BBox& a, const BBox& b) {
+  return a.minx <= b.maxx && b.minx <= a.maxx && a.miny <= b.maxy && b.miny <= a.maxy;
+}
+
+int32_t AutoCellSize(const LayerData& polys);
+
+// Multi-level grid over the layer's extent. Level k has cells of
+// cell_size << k; a polygon goes to the first level on which its bbox
+// covers at most 16 cells and is registered in each of them, so a
+// chip-wide rail costs a few entries, not thousands, while long thin wires
+// stay on fine cells. Each entry flags whether its cell is the first column / row of
+// the polygon's span; a query reports an entry only from the first cell of
+// the overlap, so every id comes out once. Queries walk the occupied
+// levels. Cells of all levels share one CSR table: the entries of cell c
+// are ids_[offs_[c], offs_[c+1]), in polygon order. The base cell grows
+// past `cell_size` if needed to keep level 0 within a few cells per
+// polygon. Built by counting sort; with threads > 1 the entries are
+// bucketed by band of cells in one pass and each worker fills a band.
+class GridIndex {
+public:
+  // false (empty index) if the layer has more polygons than an entry can hold
+  bool Build(const LayerData& polys, int32_t cell_size, int threads = 1);
+  void Query(const BBox& q, std::vector<int>& out) const; // append
+  size_t MemoryBytes() const;
+private:
+  struct Level {
+    int64_t cell;      // cell side
+    int32_t gw, gh;    // size in cells
+    uint32_t base;     // first cell in offs_
+  };
+  static const uint32_t kFirstCol = 1u << 30, kFirstRow = 1u << 31, kIdMask = kFirstCol - 1;
+  int32_t ox_ = 0, oy_ = 0;   // grid origin: the extent's min corner
+  std::vector<Level> levels_; // occupied levels only, finest first
+  std::vector<uint32_t> offs_;
+  std::vector<uint32_t> ids_; // polygon index | kFirstCol | kFirstRow
 };
 
-struct CellKeyHash {
-  size_t operator()(const CellKey& k) const {
-    return (uint64_t)(uint32_t)k.gx * 1315423911u ^ (uint64_t)(uint32_t)k.gy * 2654435761u;
+// Static R-tree bulk-loaded in Hilbert order of bbox centers. All boxes
+// (leaf items first, then one packed level after another) live in SoA
+// arrays; the children of a node are a contiguous run of the level below,
+// so no child pointers are stored. Queries return each id at most once,
+// and only ids whose bbox touches the query box.
+class PackedRTree {
+public:
+  static const int kNodeSize = 16;
+  void Build(const LayerData& polys, int threads = 1);
+  void Query(const BBox& q, std::vector<int>& out) const; // append
+  size_t MemoryBytes() const;
+private:
+  bool Touch(size_t i, const BBox& q) const {
+    return !(maxx_[i] < q.minx || q.maxx < minx_[i] || maxy_[i] < q.miny || q.maxy < miny_[i]);
   }
+  std::vector<int32_t> minx_, miny_, maxx_, maxy_;
+  std::vector<int> ids_;           // leaf slot -> polygon index
+  std::vector<size_t> level_end_;  // one past the last box of each level
 };
 
-int32_t AutoCellSize(const std::vector<Polygon>& polys);
-
 class SpatialIndex {
 public:
-  void Build(const std::vector<Polygon>& polys, int32_t cell_size);
-  void QueryCandidates(const Polygon& q, std::vector<int>& out) const; // append
+  // A layer too large for the grid gets the R-tree instead.
+  void Build(const LayerData& polys, IndexKind kind, int threads = 1);
+  // Both append each id at most once.
+  void QueryCandidates(const PolyView& q, std::vector<int>& out) const;
+  void QueryBox(const BBox& q, std::vector<int>& out) const;
+  // Ids whose bbox may contain p (a superset of those that do), increasing.
+  void QueryPoint(const Point& p, std::vector<int>& out) const;
+  size_t MemoryBytes() const;
+private:
+  IndexKind kind_ = IndexKind::Grid;
+  GridIndex grid_;
+  PackedRTree rtree_;
+};
+
+// Builds idx[id] for every layer with need[id] set (idx is resized to the
+// layer count). Large layers are built one after another with all threads,
+// the rest side by side with one thread each.
+void BuildIndices(const LayoutDB& db, IndexKind kind, const std::vector<char>& need,
+                  int threads, std::vector<SpatialIndex>& idx);
+
+// Per-layer indices of a LayoutDB, each built the first time Get() asks for
+// it, so layers a trace never reaches are neither indexed nor read. Get()
+// may be called concurrently; a layer is built once, by its first caller,
+// with all threads if it is large.
+//
+// For a hierarchical layout, Get() takes a part: instance parts share the
+// index of their cell master, in the master's coordinates, so each master
+// is indexed once however often it is placed. Parts() finds the parts of a
+// layer near a layout-space box by walking down the instance tree, through
+// one index per cell and layer over the bboxes of the cell's instances.
+class LayerIndices {
+public:
+  void Init(const LayoutDB& db, IndexKind kind, int threads);
+  const SpatialIndex& Get(int part) const;
+  // Appends, increasing, the parts of `layer` whose polygons may touch q:
+  // the top-level part if non-empty, then the instance parts whose placed
+  // master bbox touches q.
+  void Parts(int layer, const BBox& q, std::vector<int>& parts) const;
+  IndexKind kind() const { return kind_; }
+  // Layer and master indices built so far; not to be called while a Get()
+  // may be running.
+  void Stats(size_t& built, size_t& masters, size_t& bytes, double& build_ms) const;
 private:
-  int32_t cell_ = 1024;
-  std::unordered_map<CellKey, std::vector<int>, CellKeyHash> grid_;
+  // One lazily built index slot.
+  struct Slot {
+    std::unique_ptr<std::once_flag[]> once;
+    std::vector<SpatialIndex> idx;
+    std::vector<double> build_ms; // < 0 until built
+    void Init(size_t n) { once.reset(new std::once_flag[n]); idx.assign(n, SpatialIndex{}); build_ms.assign(n, -1.0); }
+  };
+  const SpatialIndex& Build(Slot& s, size_t k, const LayerData& L) const;
+  const LayoutDB* db_ = nullptr;
+  IndexKind kind_ = IndexKind::Grid;
+  int threads_ = 1;
+  mutable Slot layers_;   // by layer id
+  mutable Slot masters_;  // by Hierarchy master key
+  mutable Slot places_;   // instance bboxes, by Hierarchy::InstSlot()
 };
 
 } // namespace tracer
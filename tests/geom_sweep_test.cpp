@@ -0,0 +1,103 @@
+// tests/geom_sweep_test.cpp
+// Randomized check of the Manhattan edge sweep against the edge-pair loop
+// it replaces, on polygon pairs below and above kSweepMinEdgePairs.
+#include "../geom_ortho.cpp"
+#include <cstdio>
+#include <random>
+
+using namespace tracer;
+
+static std::mt19937 rng(12345);
+static int R(int a, int b) { return std::uniform_int_distribution<int>(a, b)(rng); }
+
+// Histogram polygon standing on (x0,y0): column i has width w[i] and height
+// h[i]. CCW, repeated vertices dropped.
+static std::vector<Point> Histogram(int x0, int y0, const std::vector<int>& w, const std::vector<int>& h) {
+  std::vector<int> xs{x0};
+  for (int v : w) xs.push_back(xs.back() + v);
+  std::vector<Point> p{{x0, y0}, {xs.back(), y0}};
+  for (int i=(int)w.size()-1;i>=0;i--){
+    p.push_back({xs[i+1], y0 + h[i]});
+    p.push_back({xs[i], y0 + h[i]});
+  }
+  std::vector<Point> q;
+  for (const Point& v : p)
+    if (q.empty() || q.back().x != v.x || q.back().y != v.y) q.push_back(v);
+  if (q.back().x == q[0].x && q.back().y == q[0].y) q.pop_back();
+  return q;
+}
+
+static std::vector<Point> RandomHistogram(int k, int span) {
+  std::vector<int> w, h;
+  for (int i=0;i<k;i++){ w.push_back(R(1, 4)); h.push_back(R(1, span/2)); }
+  return Histogram(R(-span, span), R(-span, span), w, h);
+}
+
+// Comb with k teeth of width 1 and height H, gaps of 3, on a spine of height 1.
+static std::vector<Point> Comb(int k, int H) {
+  std::vector<int> w, h;
+  for (int i=0;i<k;i++){
+    if (i){ w.push_back(3); h.push_back(1); }
+    w.push_back(1); h.push_back(H);
+  }
+  return Histogram(0, 0, w, h);
+}
+
+// Mirror about x=y, reversing to stay CCW.
+static void Transpose(std::vector<Point>& p) {
+  for (Point& v : p) std::swap(v.x, v.y);
+  std::reverse(p.begin(), p.end());
+}
+
+static void Add(LayerData& L, const std::vector<Point>& p) {
+  int32_t x0=p[0].x, y0=p[0].y, x1=x0, y1=y0;
+  for (const Point& v : p){
+    L.pts.push_back(v);
+    x0=std::min(x0,v.x); y0=std::min(y0,v.y); x1=std::max(x1,v.x); y1=std::max(y1,v.y);
+  }
+  L.EndPoly(x0, y0, x1, y1);
+}
+
+int main() {
+  long pairs[2] = {0, 0}, hits[2] = {0, 0}, bad = 0;
+  for (int it=0; it<20000; it++){
+    bool big = it & 1;
+    std::vector<Point> A, B;
+    if (R(0, 2)){
+      int span = R(4, 60);
+      A = RandomHistogram(big ? R(30, 70) : R(1, 8), span);
+      B = RandomHistogram(big ? R(30, 70) : R(1, 8), span);
+    } else {
+      // B is A turned by 180 degrees with its teeth in A's gaps; a jitter
+      // of one unit makes the combs touch
+      int k = big ? R(20, 40) : R(2, 4), H = R(3, 12);
+      A = Comb(k, H);
+      int ox = 4*k - 5 + R(-1, 1), oy = H + 2 + R(-1, 0);
+      for (const Point& v : A) B.push_back(Point{ox - v.x, oy - v.y});
+    }
+    if (R(0, 1)) Transpose(A);
+    if (R(0, 1)) Transpose(B);
+
+    LayerData L;
+    Add(L, A); Add(L, B);
+    PolyView a = L.Poly(0), b = L.Poly(1);
+    if (a.shape != kShapeManhattan || b.shape != kShapeManhattan) continue;
+    int bucket = (int64_t)a.n * b.n >= kSweepMinEdgePairs;
+    bool ref = PolyPolyIntersect(a, b);
+    bool got[3] = {ManhattanSweepIntersect(a, b), ManhattanSweepIntersect(b, a), PolyIntersectOrtho(a, b)};
+    pairs[bucket]++; hits[bucket] += ref;
+    for (bool g : got){
+      if (g == ref) continue;
+      if (bad++ < 5) std::printf("mismatch: %u x %u vertices, loop %d sweep %d/%d dispatch %d\n",
+                                 a.n, b.n, ref, got[0], got[1], got[2]);
+      break;
+    }
+  }
+  std::printf("below threshold: %ld pairs, %ld touching; above: %ld pairs, %ld touching\n",
+              pairs[0], hits[0], pairs[1], hits[1]);
+  for (int k=0;k<2;k++)
+    if (!hits[k] || hits[k] == pairs[k]){ std::printf("FAIL: one-sided sample\n"); return 1; }
+  if (bad){ std::printf("FAIL: %ld mismatches\n", bad); return 1; }
+  std::printf("PASS\n");
+  return 0;
+}
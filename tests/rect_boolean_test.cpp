@@ -0,0 +1,94 @@
+// tests/rect_boolean_test.cpp
+// Randomized check of the scanline RectBoolean against per-cell coverage
+// and, for A - B, against the SubtractOne splitting it replaced.
+#include <cstdio>
+#include <random>
+#include "ortho_rect.h"
+#include "tests/rect_grid.h"
+
+using namespace tracer;
+
+// ---- reference: the former RectDifference ----
+static std::vector<Rect> SubtractOne(const Rect& a, const Rect& b) {
+  int32_t ix1=std::max(a.x1,b.x1), iy1=std::max(a.y1,b.y1);
+  int32_t ix2=std::min(a.x2,b.x2), iy2=std::min(a.y2,b.y2);
+  if (ix1>=ix2 || iy1>=iy2) return {a};
+  std::vector<Rect> out;
+  if (iy2 < a.y2) out.push_back(Rect{a.x1,iy2,a.x2,a.y2});
+  if (a.y1 < iy1) out.push_back(Rect{a.x1,a.y1,a.x2,iy1});
+  if (a.x1 < ix1) out.push_back(Rect{a.x1,iy1,ix1,iy2});
+  if (ix2 < a.x2) out.push_back(Rect{ix2,iy1,a.x2,iy2});
+  return out;
+}
+
+static std::vector<Rect> OldRectDifference(const RectVec& A, const RectVec& B) {
+  std::vector<Rect> cur;
+  for (auto& a: A) if (a.x1<a.x2 && a.y1<a.y2) cur.push_back(a);
+  for (auto& b: B) {
+    if (b.x1>=b.x2 || b.y1>=b.y2) continue;
+    std::vector<Rect> next;
+    for (auto& a: cur){ auto p = SubtractOne(a, b); next.insert(next.end(), p.begin(), p.end()); }
+    cur.swap(next);
+  }
+  return cur;
+}
+
+static std::mt19937 rng(4242);
+static int R(int a, int b) { return std::uniform_int_distribution<int>(a, b)(rng); }
+
+static void RandomRects(RectVec& v, int n, int span, int32_t scale) {
+  for (int i=0;i<n;i++){
+    int x = R(0, span), y = R(0, span);
+    // some empty rects; the routines must skip them
+    int w = R(0, span/2 + 1), h = R(0, span/2 + 1);
+    v.push_back(Rect{x*scale, y*scale, (x+w)*scale, (y+h)*scale});
+  }
+}
+
+int main() {
+  const RectBoolOp ops[] = {RectBoolOp::Union, RectBoolOp::Intersect, RectBoolOp::Difference, RectBoolOp::Xor};
+  long bad = 0, rects_new = 0, rects_old = 0;
+  for (int it=0; it<20000; it++){
+    RectVec A, B;
+    int span = R(2, 40);
+    // large coordinates exercise the int32 ends of the range
+    int32_t scale = R(0, 9) ? 1 : 40000000;
+    RandomRects(A, R(0, 25), span, scale);
+    RandomRects(B, R(0, 25), span, scale);
+    RectGrid g;
+    g.AddCoords(A); g.AddCoords(B); g.Finish();
+    std::vector<int> ca, cb, co, cr;
+    g.Cover(A, ca); g.Cover(B, cb);
+
+    for (RectBoolOp op: ops){
+      RectVec out;
+      RectBoolean(A, B, op, out);
+      const char* why = nullptr;
+      if (!g.Cover(out, co)) why = "edge off the input grid";
+      for (size_t c=0; !why && c<co.size(); c++){
+        bool a = ca[c] > 0, b = cb[c] > 0, want =
+          op == RectBoolOp::Union ? a || b : op == RectBoolOp::Intersect ? a && b :
+          op == RectBoolOp::Difference ? a && !b : a != b;
+        if (co[c] > 1) why = "overlapping output";
+        else if ((co[c] == 1) != want) why = "wrong coverage";
+      }
+      for (size_t i=0; !why && i<out.size(); i++)
+        for (size_t j=0; j<out.size(); j++)
+          if (out[i].x2 == out[j].x1 && out[i].y1 == out[j].y1 && out[i].y2 == out[j].y2){ why = "unmerged x neighbours"; break; }
+
+      if (!why && op == RectBoolOp::Difference){
+        std::vector<Rect> old = OldRectDifference(A, B);
+        g.Cover(old, cr);
+        for (size_t c=0; !why && c<co.size(); c++)
+          if ((cr[c] > 0) != (co[c] > 0)) why = "differs from SubtractOne";
+        rects_new += (long)out.size();
+        rects_old += (long)old.size();
+      }
+      if (why && bad++ < 5) std::printf("iteration %d op %d: %s (|A|=%zu |B|=%zu)\n", it, (int)op, why, A.size(), B.size());
+    }
+  }
+  std::printf("difference: %ld rects, SubtractOne: %ld rects\n", rects_new, rects_old);
+  if (bad){ std::printf("FAIL: %ld mismatches\n", bad); return 1; }
+  std::printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,63 @@
+// tests/rect_grid.h
+// Coverage of rect sets and rectilinear polygons on the grid spanned by the
+// input coordinates, so a check costs O(cells) whatever the coordinate range.
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "ortho_rect.h"
+
+namespace tracer {
+
+struct RectGrid {
+  std::vector<int32_t> xs, ys;
+
+  template <class V> void AddCoords(const V& rects) {
+    for (auto& r: rects){ xs.push_back(r.x1); xs.push_back(r.x2); ys.push_back(r.y1); ys.push_back(r.y2); }
+  }
+  void Finish() {
+    std::sort(xs.begin(), xs.end()); xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+    std::sort(ys.begin(), ys.end()); ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+  }
+  int nx() const { return xs.empty() ? 0 : (int)xs.size() - 1; }
+  int ny() const { return ys.empty() ? 0 : (int)ys.size() - 1; }
+  size_t cells() const { return (size_t)nx() * ny(); }
+
+  // Index of a grid line, -1 if the coordinate is not one.
+  static int Line(const std::vector<int32_t>& v, int32_t c) {
+    auto it = std::lower_bound(v.begin(), v.end(), c);
+    return it != v.end() && *it == c ? (int)(it - v.begin()) : -1;
+  }
+
+  // Adds how many rects cover each cell; false if a rect edge is off the grid.
+  template <class V> bool Cover(const V& rects, std::vector<int>& cnt) const {
+    cnt.assign(cells(), 0);
+    for (auto& r: rects){
+      if (r.x1 >= r.x2 || r.y1 >= r.y2) continue;
+      int i1 = Line(xs, r.x1), i2 = Line(xs, r.x2), j1 = Line(ys, r.y1), j2 = Line(ys, r.y2);
+      if (i1 < 0 || i2 < 0 || j1 < 0 || j2 < 0) return false;
+      for (int j=j1;j<j2;j++) for (int i=i1;i<i2;i++) cnt[(size_t)j*nx() + i]++;
+    }
+    return true;
+  }
+
+  // Winding number of each cell under closed rectilinear loops (CCW outer,
+  // CW holes); false if a vertical edge is off the grid.
+  bool Winding(const std::vector<std::vector<Point>>& polys, std::vector<int>& w) const {
+    w.assign(cells(), 0);
+    for (auto& p: polys){
+      for (size_t k=0;k<p.size();k++){
+        const Point& a = p[k];
+        const Point& b = p[(k+1)%p.size()];
+        if (a.x != b.x || a.y == b.y) continue;
+        int i = Line(xs, a.x), j1 = Line(ys, std::min(a.y, b.y)), j2 = Line(ys, std::max(a.y, b.y));
+        if (i < 0 || j1 < 0 || j2 < 0) return false;
+        // an upward edge has the interior on its left
+        int d = b.y > a.y ? 1 : -1;
+        for (int j=j1;j<j2;j++) for (int c=0;c<i;c++) w[(size_t)j*nx() + c] += d;
+      }
+    }
+    return true;
+  }
+};
+
+} // namespace tracer
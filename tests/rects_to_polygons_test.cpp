@@ -0,0 +1,191 @@
+// tests/rects_to_polygons_test.cpp
+// Randomized check of RectsToPolygons: the loops must enclose exactly the
+// union of the rects with no internal edges, and wherever the former
+// multiset edge cancellation traced such loops the new routine must trace
+// the same ones.
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include "ortho_rect.h"
+#include "tests/rect_grid.h"
+
+using namespace tracer;
+
+// ---- reference: the former RectsToPolygons ----
+struct OldEdge { int32_t x1,y1,x2,y2;
+  bool operator<(const OldEdge& o) const {
+    if (x1!=o.x1) return x1<o.x1;
+    if (y1!=o.y1) return y1<o.y1;
+    if (x2!=o.x2) return x2<o.x2;
+    return y2<o.y2;
+  }
+};
+
+static void AddOrCancel(std::multiset<OldEdge>& edges, const OldEdge& e) {
+  auto it = edges.find(OldEdge{e.x2,e.y2,e.x1,e.y1});
+  if (it!=edges.end()) edges.erase(it);
+  else edges.insert(e);
+}
+
+static std::vector<std::vector<Point>> OldRectsToPolygons(const RectVec& rects) {
+  std::multiset<OldEdge> edges;
+  for (auto& r: rects) {
+    if (r.x1>=r.x2 || r.y1>=r.y2) continue;
+    AddOrCancel(edges, OldEdge{r.x1,r.y1,r.x2,r.y1});
+    AddOrCancel(edges, OldEdge{r.x2,r.y1,r.x2,r.y2});
+    AddOrCancel(edges, OldEdge{r.x2,r.y2,r.x1,r.y2});
+    AddOrCancel(edges, OldEdge{r.x1,r.y2,r.x1,r.y1});
+  }
+  auto pack=[](int32_t x,int32_t y)->uint64_t{ return (uint64_t)(uint32_t)x<<32 | (uint32_t)y; };
+  std::unordered_map<uint64_t, std::vector<OldEdge>> adj;
+  for (auto& e: edges) adj[pack(e.x1,e.y1)].push_back(e);
+  auto dirRank=[](const OldEdge& e)->int{
+    int32_t dx=e.x2-e.x1, dy=e.y2-e.y1;
+    if (dy==0 && dx>0) return 0;
+    if (dx==0 && dy>0) return 1;
+    if (dy==0 && dx<0) return 2;
+    return 3;
+  };
+  for (auto& kv: adj)
+    std::sort(kv.second.begin(), kv.second.end(), [&](const OldEdge& a,const OldEdge& b){return dirRank(a)<dirRank(b);});
+
+  std::set<OldEdge> used;
+  std::vector<std::vector<Point>> polys;
+  for (auto& e0: edges) {
+    if (used.count(e0)) continue;
+    std::vector<Point> poly;
+    OldEdge cur=e0;
+    used.insert(cur);
+    poly.push_back(Point{cur.x1,cur.y1});
+    while (true) {
+      Point end{cur.x2,cur.y2};
+      if (end.x==e0.x1 && end.y==e0.y1) break;
+      poly.push_back(end);
+      auto it=adj.find(pack(end.x,end.y));
+      if (it==adj.end() || it->second.empty()) break;
+      OldEdge nxt=it->second[0];
+      for (auto& cand: it->second)
+        if (!(cand.x2==cur.x1 && cand.y2==cur.y1)) { nxt=cand; break; }
+      if (used.count(nxt)) break;
+      used.insert(nxt);
+      cur=nxt;
+    }
+    if (poly.size()>=4) polys.push_back(std::move(poly));
+  }
+  return polys;
+}
+
+static std::mt19937 rng(777);
+static int R(int a, int b) { return std::uniform_int_distribution<int>(a, b)(rng); }
+
+// Drops collinear vertices and starts each loop at its smallest vertex, so
+// loops that differ only in split points and start compare equal.
+static std::vector<std::vector<std::pair<int32_t,int32_t>>> Canonical(const std::vector<std::vector<Point>>& polys) {
+  std::vector<std::vector<std::pair<int32_t,int32_t>>> out;
+  for (auto& p: polys){
+    std::vector<std::pair<int32_t,int32_t>> q;
+    size_t n = p.size();
+    for (size_t k=0;k<n;k++){
+      const Point& a = p[(k+n-1)%n]; const Point& b = p[k]; const Point& c = p[(k+1)%n];
+      bool straight = (a.x == b.x && b.x == c.x) || (a.y == b.y && b.y == c.y);
+      if (!straight) q.emplace_back(b.x, b.y);
+    }
+    std::rotate(q.begin(), std::min_element(q.begin(), q.end()), q.end());
+    out.push_back(q);
+  }
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+// True if the loops close with axis-parallel edges, every cell has winding
+// 0 or 1 and the 1s are the covered cells.
+static bool Encloses(const RectGrid& g, const std::vector<std::vector<Point>>& polys, const std::vector<int>& cover) {
+  for (auto& p: polys)
+    for (size_t k=0;k<p.size();k++){
+      const Point& a = p[k]; const Point& b = p[(k+1)%p.size()];
+      if (a.x != b.x && a.y != b.y) return false;
+    }
+  std::vector<int> w;
+  if (!g.Winding(polys, w)) return false;
+  for (size_t c=0;c<w.size();c++)
+    if (w[c] != (cover[c] > 0 ? 1 : 0)) return false;
+  return true;
+}
+
+static int64_t Length(const std::vector<std::vector<Point>>& polys) {
+  int64_t len = 0;
+  for (auto& p: polys)
+    for (size_t k=0;k<p.size();k++){
+      const Point& a = p[k]; const Point& b = p[(k+1)%p.size()];
+      len += std::abs((int64_t)b.x - a.x) + std::abs((int64_t)b.y - a.y);
+    }
+  return len;
+}
+
+// Perimeter of the covered cells' union.
+static int64_t Perimeter(const RectGrid& g, const std::vector<int>& cover) {
+  auto in = [&](int i, int j){ return i>=0 && j>=0 && i<g.nx() && j<g.ny() && cover[(size_t)j*g.nx() + i] > 0; };
+  int64_t len = 0;
+  for (int j=0;j<g.ny();j++) for (int i=0;i<g.nx();i++){
+    if (!in(i, j)) continue;
+    int64_t w = (int64_t)g.xs[i+1] - g.xs[i], h = (int64_t)g.ys[j+1] - g.ys[j];
+    len += (in(i, j-1) ? 0 : w) + (in(i, j+1) ? 0 : w) + (in(i-1, j) ? 0 : h) + (in(i+1, j) ? 0 : h);
+  }
+  return len;
+}
+
+int main() {
+  long bad = 0, old_ok = 0, tests = 0;
+  for (int it=0; it<20000; it++){
+    RectVec rects;
+    if (it & 1){
+      // disjoint rects from unit cells of a grid with uneven column and
+      // row widths: edges cancel whole, corners touch
+      int k = R(1, 8);
+      std::vector<int32_t> xs{0}, ys{0};
+      for (int i=0;i<k;i++){ xs.push_back(xs.back() + R(1, 5)); ys.push_back(ys.back() + R(1, 5)); }
+      int fill = R(20, 90);
+      for (int j=0;j<k;j++) for (int i=0;i<k;i++)
+        if (R(0, 99) < fill) rects.push_back(Rect{xs[i], ys[j], xs[i+1], ys[j+1]});
+    } else {
+      // the union of random rects as RectBoolean returns it: T-junctions
+      // between rects of different spans, holes
+      RectVec in, none;
+      int span = R(4, 30);
+      for (int n=R(1, 20); n>0; n--){
+        int x = R(0, span), y = R(0, span);
+        in.push_back(Rect{x, y, x + R(1, span/2), y + R(1, span/2)});
+      }
+      RectBoolean(in, none, RectBoolOp::Union, rects);
+    }
+    RectGrid g;
+    g.AddCoords(rects); g.Finish();
+    std::vector<int> cover;
+    g.Cover(rects, cover);
+
+    auto polys = RectsToPolygons(rects);
+    const char* why = nullptr;
+    for (auto& p: polys)
+      for (size_t k=0; !why && k<p.size(); k++){
+        const Point& a = p[k]; const Point& b = p[(k+1)%p.size()]; const Point& c = p[(k+2)%p.size()];
+        if ((a.x == b.x && b.x == c.x) || (a.y == b.y && b.y == c.y)) why = "collinear vertex";
+      }
+    int64_t perimeter = Perimeter(g, cover);
+    if (!why && !Encloses(g, polys, cover)) why = "loops do not enclose the union";
+    if (!why && Length(polys) != perimeter) why = "internal edges left";
+    // T-junctions leave the old loops overlapping along internal edges
+    auto old = OldRectsToPolygons(rects);
+    if (Encloses(g, old, cover) && Length(old) == perimeter){
+      old_ok++;
+      if (!why && Canonical(old) != Canonical(polys)) why = "differs from multiset cancellation";
+    }
+    tests++;
+    if (why && bad++ < 5) std::printf("iteration %d: %s (%zu rects)\n", it, why, rects.size());
+  }
+  std::printf("%ld rect sets, multiset cancellation correct on %ld\n", tests, old_ok);
+  if (bad){ std::printf("FAIL: %ld mismatches\n", bad); return 1; }
+  std::printf("PASS\n");
+  return 0;
+}
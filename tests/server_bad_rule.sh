@@ -0,0 +1,20 @@
+#!/bin/sh
+# Usage: tests/server_bad_rule.sh path/to/trace
+# Malformed StartPos lines must be answered with "ERR bad rule" while the
+# server (-serve -) keeps answering the requests after them.
+set -e
+bin=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'M1\n(0,0),(10,0),(10,10),(0,10)\n' > "$dir/layout.txt"
+printf 'StartPos\nM1 (a,5)\nEND\nStartPos\nM1 (99999999999,5)\nEND\nStartPos\nM1 (5,5)\nEND\n' \
+  | "$bin" -layout "$dir/layout.txt" -serve - > "$dir/out.txt" 2> "$dir/err.txt"
+
+printf 'ERR bad rule\nERR bad rule\nOK 31\nM1\n(0,0),(10,0),(10,10),(0,10)\n' > "$dir/expected.txt"
+if ! cmp -s "$dir/out.txt" "$dir/expected.txt"; then
+  echo "FAIL: unexpected server replies:"
+  cat "$dir/out.txt"
+  exit 1
+fi
+echo "PASS"
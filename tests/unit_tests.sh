@@ -0,0 +1,28 @@
+#!/bin/sh
+# Usage: tests/unit_tests.sh
+# Builds and runs every tests/*_test.cpp. A test that includes a source file
+# to reach its static helpers is linked with the remaining sources only.
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+cxx="${CXX:-g++} -std=c++17 -O2 -pthread -I$root"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for s in "$root"/*.cpp; do
+  $cxx -c "$s" -o "$dir/$(basename "$s" .cpp).o" &
+done
+wait
+
+status=0
+for t in "$root"/tests/*_test.cpp; do
+  objs=""
+  for s in "$root"/*.cpp; do
+    b=$(basename "$s")
+    grep -q "#include \"../$b\"" "$t" || objs="$objs $dir/${b%.cpp}.o"
+  done
+  name=$(basename "$t" .cpp)
+  echo "== $name"
+  $cxx "$t" $objs -o "$dir/$name"
+  "$dir/$name" || status=1
+done
+exit $status
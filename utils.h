@@ -23,6 +23,20 @@ static inline bool IsLayerLine(const std::string& s) {
   return true;
 }
 
+// In-place variants over a [b,e) character range (no copies).
+static inline bool IsSpaceChar(char c) { return c==' '||c=='\t'||c=='\r'||c=='\n'; }
+
+static inline void TrimRange(const char*& b, const char*& e) {
+  while (b < e && IsSpaceChar(*b)) ++b;
+  while (e > b && IsSpaceChar(e[-1])) --e;
+}
+
+static inline bool IsLayerLine(const char* b, const char* e) {
+  if (b == e) return false;
+  for (; b < e; ++b) if (!IsLayerTokenChar(*b)) return false;
+  return true;
+}
+
 static inline std::vector<std::string> SplitWS(const std::string& s) {
   std::istringstream iss(s);
   std::vector<std::string> out;
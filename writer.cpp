@@ -1,33 +1,162 @@
 #include "writer.h"
-#include <fstream>
-#include <vector>
 #include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <filesystem>
 
 namespace tracer {
 
-static void WritePolyLine(std::ofstream& out, const std::vector<Point>& pts) {
-  for (size_t i=0;i<pts.size();i++){
-    out << "(" << pts[i].x << "," << pts[i].y << ")";
-    if (i+1<pts.size()) out << ",";
+static const size_t kBlockBytes = 1 << 20;
+// Full blocks allowed to wait for the writer thread before AddPolygon blocks.
+static const size_t kMaxPendingBlocks = 4;
+
+// Upper bound of one formatted vertex: "(" int "," int ")," plus newline slack.
+static inline size_t MaxPolyChars(size_t n) { return n * 26 + 2; }
+
+static char* FormatPolyLine(char* p, const Point* pts, size_t n) {
+  for (size_t i=0;i<n;i++){
+    *p++ = '(';
+    p = std::to_chars(p, p + 11, pts[i].x).ptr;
+    *p++ = ',';
+    p = std::to_chars(p, p + 11, pts[i].y).ptr;
+    *p++ = ')';
+    if (i+1<n) *p++ = ',';
   }
-  out << "\n";
+  *p++ = '\n';
+  return p;
 }
 
-bool WriteResult(const std::string& path, const TraceResult& res) {
-  std::ofstream out(path, std::ios::out | std::ios::binary);
-  if (!out) return false;
+ResultWriter::~ResultWriter() { Abort(); }
+
+bool ResultWriter::Open(const std::string& path) {
+  path_ = path;
+  tmp_path_ = path + ".tmp";
+  out_.open(tmp_path_, std::ios::out | std::ios::binary);
+  if (!out_) return false;
+  block_.resize(kBlockBytes);
+  used_ = 0;
+  closing_ = false;
+  ok_ = true;
+  thread_ = std::thread([this]{ WriterLoop(); });
+  return true;
+}
+
+char* ResultWriter::Reserve(size_t n) {
+  if (used_ + n > block_.size()) {
+    Flush();
+    if (n > block_.size()) block_.resize(n); // one huge polygon
+  }
+  return block_.data() + used_;
+}
+
+void ResultWriter::BeginLayer(const std::string& name) {
+  char* p = Reserve(name.size() + 1);
+  std::copy(name.begin(), name.end(), p);
+  p[name.size()] = '\n';
+  used_ += name.size() + 1;
+  layers_++;
+}
+
+void ResultWriter::AddPolygon(const Point* pts, size_t n) {
+  char* p = Reserve(MaxPolyChars(n));
+  used_ = FormatPolyLine(p, pts, n) - block_.data();
+  polygons_++;
+}
+
+void ResultWriter::Flush() {
+  if (used_ == 0) return;
+  std::unique_lock<std::mutex> lk(mu_);
+  cv_.wait(lk, [&]{ return pending_.size() < kMaxPendingBlocks; });
+  pending_.push_back(std::move(block_));
+  pending_used_.push_back(used_);
+  if (!spare_.empty()) { block_ = std::move(spare_.back()); spare_.pop_back(); }
+  else block_.clear();
+  lk.unlock();
+  cv_.notify_all();
+  if (block_.size() < kBlockBytes) block_.resize(kBlockBytes);
+  used_ = 0;
+}
+
+void ResultWriter::WriterLoop() {
+  std::unique_lock<std::mutex> lk(mu_);
+  while (true) {
+    cv_.wait(lk, [&]{ return !pending_.empty() || closing_; });
+    if (pending_.empty()) return; // closing and drained
+    std::vector<char> blk = std::move(pending_.front());
+    size_t n = pending_used_.front();
+    pending_.erase(pending_.begin());
+    pending_used_.erase(pending_used_.begin());
+    lk.unlock();
+    out_.write(blk.data(), (std::streamsize)n);
+    lk.lock();
+    if (!out_) ok_ = false;
+    spare_.push_back(std::move(blk));
+    cv_.notify_all();
+  }
+}
+
+// Drains the pending blocks and closes the temporary file.
+bool ResultWriter::Finish() {
+  Flush();
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    closing_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  out_.close();
+  if (out_.fail()) ok_ = false;
+  return ok_;
+}
+
+bool ResultWriter::Close() {
+  if (!thread_.joinable()) return ok_;
+  std::error_code ec;
+  if (Finish()) std::filesystem::rename(tmp_path_, path_, ec);
+  if (!ok_ || ec) {
+    std::remove(tmp_path_.c_str());
+    ok_ = false;
+  }
+  return ok_;
+}
 
+void ResultWriter::Abort() {
+  if (!thread_.joinable()) return;
+  used_ = 0; // the unwritten block is dropped
+  Finish();
+  std::remove(tmp_path_.c_str());
+  ok_ = false;
+}
+
+static std::vector<std::string> SortedLayers(const TraceResult& res) {
   std::vector<std::string> layers;
   layers.reserve(res.by_layer.size());
   for (auto& kv: res.by_layer) layers.push_back(kv.first);
   std::sort(layers.begin(), layers.end());
+  return layers;
+}
+
+bool WriteResult(const std::string& path, const TraceResult& res) {
+  ResultWriter w;
+  if (!w.Open(path)) return false;
+  for (auto& layer: SortedLayers(res)) {
+    w.BeginLayer(layer);
+    for (auto& poly: res.by_layer.at(layer)) w.AddPolygon(poly.data(), poly.size());
+  }
+  return w.Close();
+}
 
-  for (auto& layer: layers) {
+bool WriteResult(std::ostream& out, const TraceResult& res) {
+  std::vector<char> buf;
+  for (auto& layer: SortedLayers(res)) {
     out << layer << "\n";
-    const auto& polys = res.by_layer.at(layer);
-    for (auto& poly: polys) WritePolyLine(out, poly);
+    for (auto& poly: res.by_layer.at(layer)) {
+      buf.resize(MaxPolyChars(poly.size()));
+      char* e = FormatPolyLine(buf.data(), poly.data(), poly.size());
+      out.write(buf.data(), e - buf.data());
+    }
   }
-  return true;
+  return (bool)out;
 }
 
 } // namespace tracer
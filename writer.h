@@ -0,0 +1,64 @@
+// src/writer.h
+#pragma once
+#include "engine.h"
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace tracer {
+
+// Streams a result file as a trace produces it. Text is formatted with
+// std::to_chars into large blocks, and a background thread writes full
+// blocks while the trace keeps running. The blocks go to "<path>.tmp",
+// renamed to `path` by a successful Close(), so a failed trace leaves any
+// previous result in place.
+class ResultWriter : public ResultSink {
+public:
+  ResultWriter() = default;
+  ~ResultWriter();
+  ResultWriter(const ResultWriter&) = delete;
+  ResultWriter& operator=(const ResultWriter&) = delete;
+
+  bool Open(const std::string& path);
+  void BeginLayer(const std::string& name) override;
+  void AddPolygon(const Point* pts, size_t n) override;
+  // Writes what is left, stops the writer thread and moves the file into
+  // place; false (and no file) if any write failed.
+  bool Close();
+  // Stops the writer thread and deletes the partial file. Also what the
+  // destructor does with a writer that was not closed.
+  void Abort();
+
+  size_t layers() const { return layers_; }
+  size_t polygons() const { return polygons_; }
+
+private:
+  char* Reserve(size_t n);
+  void Flush();
+  void WriterLoop();
+  bool Finish();
+
+  std::string path_, tmp_path_;
+  std::ofstream out_;
+  std::vector<char> block_;
+  size_t used_ = 0;
+  size_t layers_ = 0, polygons_ = 0;
+
+  std::thread thread_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::vector<std::vector<char>> pending_, spare_; // full blocks / recycled ones
+  std::vector<size_t> pending_used_;
+  bool closing_ = false;
+  bool ok_ = true;
+};
+
+// Layers in name order, one polygon per line: (x,y),(x,y),...
+bool WriteResult(const std::string& path, const TraceResult& res);
+bool WriteResult(std::ostream& out, const TraceResult& res);
+
+} // namespace tracer